@@ -0,0 +1,234 @@
+#ifndef _BANDED_ALIGNER_H_
+#define _BANDED_ALIGNER_H_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+namespace Sibelia
+{
+	//Global alignment with unit edit costs. Only the cells within a band around
+	//the line between the corners of the matrix are computed. A row is computed
+	//with SSE2: the diagonal and vertical moves directly, the horizontal ones
+	//with a prefix minimum over the lanes. Long sequences are aligned in tiles,
+	//only the first half of the path through a tile is kept
+	class BandedAligner
+	{
+	public:
+		struct Result
+		{
+			std::string cigar;
+			size_t matches;
+			size_t columns;
+		};
+
+		BandedAligner(size_t band) : band_(band < 1 ? 1 : (band < MAX_BAND ? band : MAX_BAND))
+		{
+
+		}
+
+		//The CIGAR describes the query against the target
+		void Align(const std::string & query, const std::string & target, Result & result)
+		{
+			//The longer sequence is put on the rows, so a row shifts the band
+			//by at most one column
+			bool swap = target.size() > query.size();
+			const std::string & row = swap ? target : query;
+			const std::string & column = swap ? query : target;
+			op_.clear();
+			for (size_t i = 0, j = 0; i < row.size() || j < column.size(); )
+			{
+				size_t rows = row.size() - i;
+				size_t columns = column.size() - j;
+				size_t keep = rows;
+				if (rows > TILE_ROWS)
+				{
+					columns = (columns * TILE_ROWS + rows / 2) / rows;
+					rows = TILE_ROWS;
+					keep = TILE_ROWS / 2;
+				}
+
+				AlignTile(row.data() + i, rows, column.data() + j, columns, keep, i, j);
+			}
+
+			result.cigar.clear();
+			result.matches = 0;
+			result.columns = op_.size();
+			for (size_t k = 0, i = 0, j = 0; k < op_.size(); )
+			{
+				size_t run = k;
+				for (; run < op_.size() && op_[run] == op_[k]; run++)
+				{
+					if (op_[run] == DIAGONAL)
+					{
+						result.matches += row[i++] == column[j++] ? 1 : 0;
+					}
+					else
+					{
+						i += op_[run] == VERTICAL ? 1 : 0;
+						j += op_[run] == HORIZONTAL ? 1 : 0;
+					}
+				}
+
+				result.cigar += std::to_string(run - k);
+				result.cigar.push_back(op_[k] == DIAGONAL ? 'M' : ((op_[k] == VERTICAL) != swap ? 'I' : 'D'));
+				k = run;
+			}
+		}
+
+	private:
+		static const size_t LANES = 8;
+		static const size_t TILE_ROWS = 1 << 12;
+		static const size_t MAX_BAND = 1 << 12;
+		static const int16_t INF = 1 << 14;
+		static const uint8_t DIAGONAL = 0;
+		static const uint8_t VERTICAL = 1;
+		static const uint8_t HORIZONTAL = 2;
+
+		size_t band_;
+		std::vector<uint8_t> op_;
+		std::vector<uint8_t> trace_;
+		std::vector<int16_t> row_[2];
+		std::vector<int16_t> column_;
+		std::vector<int16_t> penalty_;
+
+		//The first column of the band in a row, it can be negative
+		int64_t BandStart(size_t i, size_t rows, size_t columns) const
+		{
+			return int64_t(rows > 0 ? (i * columns + rows / 2) / rows : 0) - int64_t(band_);
+		}
+
+		//Aligns the tile globally and appends the path up to the row keep. The
+		//row buffers are padded, as the band of a later tile can shift by a
+		//few columns per row
+		void AlignTile(const char * row, size_t rows, const char * column, size_t columns, size_t keep, size_t & i0, size_t & j0)
+		{
+			size_t width = (2 * band_ + 1 + LANES - 1) / LANES * LANES;
+			//The characters and penalties are stored with padding, so that
+			//the band can be read at any shift
+			size_t pad = width + LANES;
+			column_.assign(columns + 2 * pad, int16_t(-1));
+			penalty_.assign(columns + 2 * pad, int16_t(INF));
+			for (size_t j = 0; j <= columns; j++)
+			{
+				column_[pad + j] = j > 0 ? column[j - 1] : -1;
+				penalty_[pad + j] = 0;
+			}
+
+			trace_.resize((rows + 1) * width);
+			for (auto & r : row_)
+			{
+				r.assign(width + 4 * LANES, int16_t(INF));
+			}
+
+			int16_t * prev = row_[0].data() + LANES;
+			int16_t * cur = row_[1].data() + LANES;
+			int64_t start = BandStart(0, rows, columns);
+			for (size_t k = 0; k < width; k++)
+			{
+				int64_t j = start + int64_t(k);
+				prev[k] = j >= 0 && j <= int64_t(columns) ? int16_t(j) : INF;
+				trace_[k] = HORIZONTAL;
+			}
+
+			for (size_t i = 1; i <= rows; i++)
+			{
+				int64_t nowStart = BandStart(i, rows, columns);
+				size_t shift = size_t(nowStart - start);
+				start = nowStart;
+				const int16_t * ch = column_.data() + pad + start;
+				const int16_t * penalty = penalty_.data() + pad + start;
+				ComputeRow(int16_t(row[i - 1]), ch, penalty, prev + shift, cur, trace_.data() + i * width, width);
+				std::swap(prev, cur);
+			}
+
+			//The traceback goes from the end of the tile to its start
+			size_t mark = op_.size();
+			for (int64_t i = rows, j = columns; i > 0 || j > 0; )
+			{
+				uint8_t op = trace_[i * width + size_t(j - BandStart(i, rows, columns))];
+				op_.push_back(op);
+				i -= op != HORIZONTAL ? 1 : 0;
+				j -= op != VERTICAL ? 1 : 0;
+			}
+
+			std::reverse(op_.begin() + mark, op_.end());
+			size_t i = 0;
+			size_t j = 0;
+			size_t end = mark;
+			for (; end < op_.size() && (i < keep || keep == rows); end++)
+			{
+				i += op_[end] != HORIZONTAL ? 1 : 0;
+				j += op_[end] != VERTICAL ? 1 : 0;
+			}
+
+			op_.resize(end);
+			i0 += i;
+			j0 += j;
+		}
+
+#ifdef __SSE2__
+		//Lanes are shifted towards higher indices, the freed ones are set to INF
+		static __m128i ShiftLanes(__m128i v, __m128i fill, int lanes)
+		{
+			switch (lanes)
+			{
+			case 1:
+				return _mm_or_si128(_mm_slli_si128(v, 2), _mm_srli_si128(fill, 14));
+			case 2:
+				return _mm_or_si128(_mm_slli_si128(v, 4), _mm_srli_si128(fill, 12));
+			default:
+				return _mm_or_si128(_mm_slli_si128(v, 8), _mm_srli_si128(fill, 8));
+			}
+		}
+
+		static void ComputeRow(int16_t ch, const int16_t * column, const int16_t * penalty, const int16_t * prev, int16_t * cur, uint8_t * trace, size_t width)
+		{
+			const __m128i one = _mm_set1_epi16(1);
+			const __m128i inf = _mm_set1_epi16(INF);
+			const __m128i step = _mm_set_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+			const __m128i rowChar = _mm_set1_epi16(ch);
+			int16_t carry = INF;
+			for (size_t k = 0; k < width; k += LANES)
+			{
+				__m128i mismatch = _mm_andnot_si128(_mm_cmpeq_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(column + k)), rowChar), one);
+				__m128i diagonal = _mm_adds_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(prev + k - 1)), mismatch);
+				__m128i vertical = _mm_adds_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(prev + k)), one);
+				__m128i pen = _mm_loadu_si128(reinterpret_cast<const __m128i*>(penalty + k));
+				__m128i now = _mm_adds_epi16(_mm_min_epi16(diagonal, vertical), pen);
+				now = _mm_min_epi16(now, _mm_adds_epi16(ShiftLanes(now, inf, 1), _mm_set1_epi16(1)));
+				now = _mm_min_epi16(now, _mm_adds_epi16(ShiftLanes(now, inf, 2), _mm_set1_epi16(2)));
+				now = _mm_min_epi16(now, _mm_adds_epi16(ShiftLanes(now, inf, 4), _mm_set1_epi16(4)));
+				now = _mm_min_epi16(now, _mm_adds_epi16(_mm_set1_epi16(carry), step));
+				now = _mm_min_epi16(_mm_adds_epi16(now, pen), inf);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(cur + k), now);
+				carry = int16_t(_mm_extract_epi16(now, 7));
+				__m128i notDiagonal = _mm_andnot_si128(_mm_cmpeq_epi16(now, diagonal), one);
+				__m128i horizontal = _mm_andnot_si128(_mm_cmpeq_epi16(now, vertical), one);
+				__m128i op = _mm_add_epi16(notDiagonal, _mm_and_si128(notDiagonal, horizontal));
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(trace + k), _mm_packus_epi16(op, op));
+			}
+		}
+#else
+		static void ComputeRow(int16_t ch, const int16_t * column, const int16_t * penalty, const int16_t * prev, int16_t * cur, uint8_t * trace, size_t width)
+		{
+			int16_t left = INF;
+			for (size_t k = 0; k < width; k++)
+			{
+				int16_t diagonal = std::min<int>(prev[k - 1] + (column[k] == ch ? 0 : 1), INF);
+				int16_t vertical = std::min<int>(prev[k] + 1, INF);
+				int16_t now = std::min<int>(std::min(std::min(diagonal, vertical), int16_t(left + 1)) + penalty[k], INF);
+				trace[k] = now == diagonal ? DIAGONAL : (now == vertical ? VERTICAL : HORIZONTAL);
+				cur[k] = left = now;
+			}
+		}
+#endif
+	};
+}
+
+#endif
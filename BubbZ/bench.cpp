@@ -0,0 +1,652 @@
+#include <new>
+#include <random>
+#include <chrono>
+#include <cstdlib>
+#include <unordered_map>
+
+#include <tclap/CmdLine.h>
+
+#include "blocksfinder.h"
+
+//Every allocation of the benchmark is counted, so the sweeps can be checked
+//for allocations on the hot path. All forms of new and delete are replaced,
+//they share the counter and end up in malloc and free. The helpers are not
+//inlined, so the compiler does not pair free with new at the call sites
+std::atomic<uint64_t> allocations(0);
+
+__attribute__((noinline)) void * Allocate(size_t size, size_t alignment = 0)
+{
+	allocations++;
+	size = size > 0 ? size : 1;
+	if (alignment <= sizeof(void*))
+	{
+		return malloc(size);
+	}
+
+	void * ret = 0;
+	return posix_memalign(&ret, alignment, size) == 0 ? ret : 0;
+}
+
+__attribute__((noinline)) void Release(void * ptr)
+{
+	free(ptr);
+}
+
+void * AllocateOrThrow(size_t size, size_t alignment = 0)
+{
+	void * ret = Allocate(size, alignment);
+	if (ret == 0)
+	{
+		throw std::bad_alloc();
+	}
+
+	return ret;
+}
+
+void * operator new(size_t size)
+{
+	return AllocateOrThrow(size);
+}
+
+void * operator new[](size_t size)
+{
+	return AllocateOrThrow(size);
+}
+
+void * operator new(size_t size, const std::nothrow_t &) noexcept
+{
+	return Allocate(size);
+}
+
+void * operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+	return Allocate(size);
+}
+
+void operator delete(void * ptr) noexcept
+{
+	Release(ptr);
+}
+
+void operator delete[](void * ptr) noexcept
+{
+	Release(ptr);
+}
+
+void operator delete(void * ptr, size_t) noexcept
+{
+	Release(ptr);
+}
+
+void operator delete[](void * ptr, size_t) noexcept
+{
+	Release(ptr);
+}
+
+void operator delete(void * ptr, const std::nothrow_t &) noexcept
+{
+	Release(ptr);
+}
+
+void operator delete[](void * ptr, const std::nothrow_t &) noexcept
+{
+	Release(ptr);
+}
+
+#ifdef __cpp_aligned_new
+void * operator new(size_t size, std::align_val_t alignment)
+{
+	return AllocateOrThrow(size, size_t(alignment));
+}
+
+void * operator new[](size_t size, std::align_val_t alignment)
+{
+	return AllocateOrThrow(size, size_t(alignment));
+}
+
+void * operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+	return Allocate(size, size_t(alignment));
+}
+
+void * operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+	return Allocate(size, size_t(alignment));
+}
+
+void operator delete(void * ptr, std::align_val_t) noexcept
+{
+	Release(ptr);
+}
+
+void operator delete[](void * ptr, std::align_val_t) noexcept
+{
+	Release(ptr);
+}
+
+void operator delete(void * ptr, size_t, std::align_val_t) noexcept
+{
+	Release(ptr);
+}
+
+void operator delete[](void * ptr, size_t, std::align_val_t) noexcept
+{
+	Release(ptr);
+}
+
+void operator delete(void * ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+	Release(ptr);
+}
+
+void operator delete[](void * ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+	Release(ptr);
+}
+#endif
+
+typedef std::chrono::steady_clock Clock;
+
+double Seconds(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+//Times the calls the sweeper reports and counts the allocations made inside
+//them. The sweeps it is passed to must run in a single thread
+class TimingProbe
+{
+public:
+	TimingProbe()
+	{
+		std::fill(calls, calls + Sibelia::SweepProbe::CALLS, 0);
+		std::fill(nanoseconds, nanoseconds + Sibelia::SweepProbe::CALLS, 0);
+		std::fill(allocated, allocated + Sibelia::SweepProbe::CALLS, 0);
+	}
+
+	void Start()
+	{
+		startAllocations_ = allocations;
+		start_ = Clock::now();
+	}
+
+	void Stop(Sibelia::SweepProbe::Call call)
+	{
+		nanoseconds[call] += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start_).count();
+		allocated[call] += allocations - startAllocations_;
+		calls[call]++;
+	}
+
+	//The time of an empty Start and Stop pair, which is subtracted from the
+	//time of every call
+	static double Overhead()
+	{
+		const size_t PAIRS = 1 << 20;
+		double ret = 0;
+		for (size_t round = 0; round < 5; round++)
+		{
+			TimingProbe probe;
+			for (size_t i = 0; i < PAIRS; i++)
+			{
+				probe.Start();
+				probe.Stop(Sibelia::SweepProbe::EXACT_LOOKUP);
+			}
+
+			double now = double(probe.nanoseconds[Sibelia::SweepProbe::EXACT_LOOKUP]) / PAIRS;
+			ret = round == 0 ? now : std::min(ret, now);
+		}
+
+		return ret;
+	}
+
+	void Add(const TimingProbe & probe)
+	{
+		for (size_t i = 0; i < Sibelia::SweepProbe::CALLS; i++)
+		{
+			calls[i] += probe.calls[i];
+			nanoseconds[i] += probe.nanoseconds[i];
+			allocated[i] += probe.allocated[i];
+		}
+	}
+
+	uint64_t calls[Sibelia::SweepProbe::CALLS];
+	uint64_t nanoseconds[Sibelia::SweepProbe::CALLS];
+	uint64_t allocated[Sibelia::SweepProbe::CALLS];
+
+private:
+	Clock::time_point start_;
+	uint64_t startAllocations_;
+};
+
+class CountingSink : public Sibelia::BlockSink
+{
+public:
+	CountingSink() : blocks(0)
+	{
+
+	}
+
+	void Consume(const Sibelia::BlockInstance *, size_t)
+	{
+		blocks++;
+	}
+
+	std::atomic<uint64_t> blocks;
+};
+
+//A synthetic collection of genomes, one chromosome each. Every genome is a
+//copy of a common ancestor with substitutions and indels, and the ancestor
+//carries copies of a repeat. The junctions are the k-mers whose hash is
+//divisible by the density, so the homologous copies share their vertices
+//like in a de Bruijn graph
+struct SyntheticGenomes
+{
+	std::vector<size_t> genome;
+	std::vector<std::string> sequence;
+	std::vector<std::string> description;
+	std::vector<TwoPaCo::JunctionPosition> junction;
+
+	SyntheticGenomes(size_t genomes, size_t length, double divergence, double indels, size_t repeatCopies, size_t repeatLength, size_t k, size_t density, uint64_t seed) : random_(seed)
+	{
+		if (k > 31)
+		{
+			throw std::runtime_error("The synthetic graph supports k up to 31");
+		}
+
+		std::string ancestor = RandomSequence(length);
+		std::string repeat = RandomSequence(repeatLength);
+		std::vector<size_t> insertion;
+		for (size_t i = 0; i < repeatCopies; i++)
+		{
+			insertion.push_back(std::uniform_int_distribution<size_t>(0, ancestor.size())(random_));
+		}
+
+		std::sort(insertion.begin(), insertion.end(), std::greater<size_t>());
+		for (size_t pos : insertion)
+		{
+			ancestor.insert(pos, Mutate(repeat, divergence, indels));
+		}
+
+		std::unordered_map<uint64_t, int64_t> vertexId;
+		for (size_t g = 0; g < genomes; g++)
+		{
+			genome.push_back(g);
+			sequence.push_back(Mutate(ancestor, divergence, indels));
+			description.push_back("genome_" + std::to_string(g));
+			AddJunctions(g, sequence.back(), k, density, vertexId);
+		}
+	}
+
+	//Writes every genome into <dir>/genome_<number>.fa
+	void WriteFasta(const std::string & dirName) const
+	{
+		const size_t LINE = 80;
+		Sibelia::CreateOutDirectory(dirName);
+		for (size_t g = 0; g < sequence.size(); g++)
+		{
+			std::string fileName = dirName + "/" + description[g] + ".fa";
+			std::ofstream out(fileName.c_str());
+			out << '>' << description[g] << std::endl;
+			for (size_t i = 0; i < sequence[g].size(); i += LINE)
+			{
+				out << sequence[g].substr(i, LINE) << std::endl;
+			}
+
+			if (!out)
+			{
+				throw std::runtime_error(("Cannot write file " + fileName).c_str());
+			}
+		}
+	}
+
+private:
+	std::mt19937_64 random_;
+
+	std::string RandomSequence(size_t length)
+	{
+		std::string ret(length, 'A');
+		for (char & ch : ret)
+		{
+			ch = "ACGT"[random_() & 3];
+		}
+
+		return ret;
+	}
+
+	std::string Mutate(const std::string & source, double divergence, double indels)
+	{
+		std::string ret;
+		std::uniform_real_distribution<double> event(0, 1);
+		for (char ch : source)
+		{
+			double r = event(random_);
+			if (r < indels / 2)
+			{
+				continue;
+			}
+
+			if (r < indels)
+			{
+				ret.push_back("ACGT"[random_() & 3]);
+			}
+
+			ret.push_back(r >= indels && r < indels + divergence ? "ACGT"[(Code(ch) + 1 + random_() % 3) & 3] : ch);
+		}
+
+		return ret;
+	}
+
+	static uint64_t Code(char ch)
+	{
+		switch (ch)
+		{
+		case 'C':
+			return 1;
+		case 'G':
+			return 2;
+		case 'T':
+			return 3;
+		}
+
+		return 0;
+	}
+
+	static uint64_t Hash(uint64_t value)
+	{
+		value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+		return value ^ (value >> 31);
+	}
+
+	void AddJunctions(size_t chr, const std::string & sequence, size_t k, size_t density, std::unordered_map<uint64_t, int64_t> & vertexId)
+	{
+		uint64_t forward = 0;
+		uint64_t reverse = 0;
+		uint64_t mask = (uint64_t(1) << (2 * k)) - 1;
+		for (size_t i = 0; i + 1 < sequence.size(); i++)
+		{
+			uint64_t code = Code(sequence[i]);
+			forward = ((forward << 2) | code) & mask;
+			reverse = (reverse >> 2) | ((3 - code) << (2 * (k - 1)));
+			if (i + 1 >= k)
+			{
+				uint64_t canonical = std::min(forward, reverse);
+				if (Hash(canonical) % density == 0)
+				{
+					auto it = vertexId.insert(std::make_pair(canonical, int64_t(vertexId.size() + 1))).first;
+					junction.push_back(TwoPaCo::JunctionPosition(chr, i + 1 - k, forward == canonical ? it->second : -it->second));
+				}
+			}
+		}
+	}
+};
+
+template<class Width>
+void Run(const SyntheticGenomes & synthetic, int64_t k, int64_t minBlockSize, int64_t maxBranchSize, int64_t threads, int64_t abundanceThreshold, size_t rounds)
+{
+	typedef Sibelia::JunctionStorage<Width> JunctionStorage;
+	typedef Sibelia::Sweeper<Width, TimingProbe> Sweeper;
+	Clock::time_point start = Clock::now();
+	uint64_t startAllocations = allocations;
+	JunctionStorage storage(synthetic.junction, synthetic.description, synthetic.sequence, synthetic.genome, k, threads, abundanceThreshold);
+	double loadTime = Seconds(start);
+	uint64_t loadAllocations = allocations - startAllocations;
+	uint64_t junctions = 0;
+	for (size_t chr = 0; chr < storage.GetChrNumber(); chr++)
+	{
+		junctions += storage.GeChrSize(chr);
+	}
+
+	if (junctions == 0)
+	{
+		throw std::runtime_error("The synthetic graph has no junctions");
+	}
+
+	//The calls are timed in a single-threaded sweep of every chromosome, the
+	//full search in FindBlocks. The fastest round is reported
+	TimingProbe best;
+	double sweepTime = 0;
+	double findTime = 0;
+	uint64_t sweepAllocations = 0;
+	uint64_t findAllocations = 0;
+	uint64_t blocks = 0;
+	for (size_t round = 0; round < rounds; round++)
+	{
+		TimingProbe probe;
+		CountingSink sink;
+		std::atomic<int64_t> blocksFound(0);
+		std::vector<char> partner(synthetic.genome.size(), 1);
+		start = Clock::now();
+		startAllocations = allocations;
+		Sibelia::BitmapPool pool;
+		typename Sibelia::InstanceSet<Width>::DirtyList dirty;
+		Sibelia::SweepArena<Width> arena(maxBranchSize, storage.GetAbundance());
+		std::vector<std::vector<Sibelia::InstanceSet<Width> > > instance(2, std::vector<Sibelia::InstanceSet<Width> >(storage.GetChrNumber()));
+		for (size_t i = 0; i < 2; i++)
+		{
+			for (size_t j = 0; j < storage.GetChrNumber(); j++)
+			{
+				instance[i][j].Init(j, i == 0, storage.GeChrSize(j), pool, dirty, arena.stats);
+			}
+		}
+
+		for (size_t chr = 0; chr < storage.GetChrNumber(); chr++)
+		{
+			Sweeper sweeper(typename JunctionStorage::Iterator(storage, chr), arena, partner, storage.GetChrNumber());
+			sweeper.Sweep(storage, minBlockSize, maxBranchSize, k, blocksFound, sink, instance);
+			probe.Add(sweeper.GetProbe());
+			Sibelia::InstanceSet<Width>::Reset(dirty);
+		}
+
+		double nowSweepTime = Seconds(start);
+		if (round == 0 || nowSweepTime < sweepTime)
+		{
+			best = probe;
+			sweepTime = nowSweepTime;
+			sweepAllocations = allocations - startAllocations;
+		}
+
+		CountingSink findSink;
+		Sibelia::BlocksFinder<Width> finder(storage, k, false);
+		start = Clock::now();
+		startAllocations = allocations;
+		finder.FindBlocks(minBlockSize, maxBranchSize, threads, findSink);
+		double nowFindTime = Seconds(start);
+		if (round == 0 || nowFindTime < findTime)
+		{
+			findTime = nowFindTime;
+			findAllocations = allocations - startAllocations;
+		}
+
+		blocks = findSink.blocks;
+	}
+
+	double overhead = TimingProbe::Overhead();
+	const char * callName[] = { "exact_lookup", "best_lookup", "purge" };
+	std::cout << "sequences\t" << storage.GetChrNumber() << std::endl;
+	std::cout << "junctions\t" << junctions << std::endl;
+	std::cout << "blocks\t" << blocks << std::endl;
+	std::cout << "probe_overhead_ns\t" << overhead << std::endl;
+	std::cout << "stage\tcalls\tseconds\tns_per_call\tns_per_junction\tallocations" << std::endl;
+	std::cout << "load\t1\t" << loadTime << '\t' << loadTime * 1e9 << '\t' << loadTime * 1e9 / junctions << '\t' << loadAllocations << std::endl;
+	for (size_t i = 0; i < Sibelia::SweepProbe::CALLS; i++)
+	{
+		double seconds = std::max(0.0, best.nanoseconds[i] - best.calls[i] * overhead) * 1e-9;
+		std::cout << callName[i] << '\t' << best.calls[i] << '\t' << seconds << '\t' << (best.calls[i] > 0 ? seconds * 1e9 / best.calls[i] : 0) << '\t' << seconds * 1e9 / junctions << '\t' << best.allocated[i] << std::endl;
+	}
+
+	std::cout << "sweep\t" << storage.GetChrNumber() << '\t' << sweepTime << '\t' << sweepTime * 1e9 / storage.GetChrNumber() << '\t' << sweepTime * 1e9 / junctions << '\t' << sweepAllocations << std::endl;
+	std::cout << "find_blocks\t1\t" << findTime << '\t' << findTime * 1e9 << '\t' << findTime * 1e9 / junctions << '\t' << findAllocations << std::endl;
+}
+
+int main(int argc, char * argv[])
+{
+	try
+	{
+		TCLAP::CmdLine cmd("BubbZ-bench, times the block search on a synthetic graph", ' ', Sibelia::VERSION);
+
+		TCLAP::ValueArg<unsigned int> genomes("g",
+			"genomes",
+			"Number of genomes",
+			false,
+			4,
+			"integer",
+			cmd);
+
+		TCLAP::ValueArg<unsigned int> length("l",
+			"length",
+			"Length of the ancestor genome",
+			false,
+			1000000,
+			"integer",
+			cmd);
+
+		TCLAP::ValueArg<double> divergence("d",
+			"divergence",
+			"Substitution rate of a genome against the ancestor",
+			false,
+			0.02,
+			"float",
+			cmd);
+
+		TCLAP::ValueArg<double> indels("i",
+			"indels",
+			"Indel rate of a genome against the ancestor",
+			false,
+			0.002,
+			"float",
+			cmd);
+
+		TCLAP::ValueArg<unsigned int> repeatCopies("r",
+			"repeats",
+			"Number of copies of the repeat in the ancestor",
+			false,
+			20,
+			"integer",
+			cmd);
+
+		TCLAP::ValueArg<unsigned int> repeatLength("",
+			"repeatlength",
+			"Length of the repeat",
+			false,
+			5000,
+			"integer",
+			cmd);
+
+		TCLAP::ValueArg<unsigned int> density("",
+			"density",
+			"One in this many k-mers is a junction",
+			false,
+			8,
+			"integer",
+			cmd);
+
+		TCLAP::ValueArg<unsigned int> seed("s",
+			"seed",
+			"Seed of the generator",
+			false,
+			1,
+			"integer",
+			cmd);
+
+		TCLAP::ValueArg<unsigned int> kvalue("k",
+			"kvalue",
+			"Value of k",
+			false,
+			25,
+			"integer",
+			cmd);
+
+		TCLAP::ValueArg<unsigned int> maxBranchSize("b",
+			"branchsize",
+			"Maximum branch size",
+			false,
+			200,
+			"integer",
+			cmd);
+
+		TCLAP::ValueArg<unsigned int> minBlockSize("m",
+			"blocksize",
+			"Minimum block size",
+			false,
+			50,
+			"integer",
+			cmd);
+
+		TCLAP::ValueArg<unsigned int> threads("t",
+			"threads",
+			"Number of worker threads of FindBlocks",
+			false,
+			1,
+			"integer",
+			cmd);
+
+		TCLAP::ValueArg<unsigned int> abundanceThreshold("a",
+			"abundance",
+			"Max abundance of a junction",
+			false,
+			150,
+			"integer",
+			cmd);
+
+		TCLAP::ValueArg<unsigned int> rounds("",
+			"rounds",
+			"Number of rounds, the fastest one is reported",
+			false,
+			3,
+			"integer",
+			cmd);
+
+		TCLAP::ValueArg<std::string> fastaDirName("",
+			"fasta",
+			"Only write the synthetic genomes as FASTA files into the directory",
+			false,
+			"",
+			"directory name",
+			cmd);
+
+		TCLAP::SwitchArg wideCoordinates("",
+			"wide",
+			"Use 64-bit coordinates",
+			cmd,
+			false);
+
+		cmd.parse(argc, argv);
+
+		Clock::time_point start = Clock::now();
+		SyntheticGenomes synthetic(genomes.getValue(),
+			length.getValue(),
+			divergence.getValue(),
+			indels.getValue(),
+			repeatCopies.getValue(),
+			repeatLength.getValue(),
+			kvalue.getValue(),
+			std::max(density.getValue(), 1U),
+			seed.getValue());
+		std::cout << "generate\t" << Seconds(start) << std::endl;
+		if (!fastaDirName.getValue().empty())
+		{
+			synthetic.WriteFasta(fastaDirName.getValue());
+		}
+		else if (wideCoordinates.getValue())
+		{
+			Run<Sibelia::WideWidth>(synthetic, kvalue.getValue(), minBlockSize.getValue(), maxBranchSize.getValue(), threads.getValue(), abundanceThreshold.getValue(), std::max(rounds.getValue(), 1U));
+		}
+		else
+		{
+			Run<Sibelia::NarrowWidth>(synthetic, kvalue.getValue(), minBlockSize.getValue(), maxBranchSize.getValue(), threads.getValue(), abundanceThreshold.getValue(), std::max(rounds.getValue(), 1U));
+		}
+	}
+	catch (TCLAP::ArgException & e)
+	{
+		std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl;
+		return 1;
+	}
+	catch (std::runtime_error & e)
+	{
+		std::cerr << "error: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -42,7 +42,6 @@ namespace Sibelia
 		return CompareBlocks(a, b, &BlockInstance::GetChrId);
 	}
 
-	JunctionStorage * JunctionStorage::this_;
 	extern const std::string VERSION = "1.1.1";
 
 	int64_t BlockInstance::GetSignedBlockId() const
@@ -143,105 +142,274 @@ namespace Sibelia
 	{
 		return std::make_pair(GetBlockId(), std::make_pair(GetChrId(), GetStart())) < std::make_pair(toCompare.GetBlockId(), std::make_pair(toCompare.GetChrId(), toCompare.GetStart()));
 	}
-	template<class It>
-	std::string Join(It start, It end, const std::string & delimiter)
+
+	template<class Width>
+	void BlocksFinder<Width>::ReadBlocks(const std::string & fileName, BlockSink & sink)
 	{
-		It last = --end;
-		std::stringstream ss;
-		for (; start != end; ++start)
+		std::vector<BlockInstance> block;
+		std::ifstream in(fileName.c_str());
+		if (!in)
 		{
-			ss << *start << delimiter;
+			throw std::runtime_error(("Cannot open file " + fileName).c_str());
 		}
 
-		ss << *last;
-		return ss.str();
+		for (std::string line; std::getline(in, line); )
+		{
+			if (line.empty() || line[0] == '#')
+			{
+				continue;
+			}
+
+			//The sequence description may contain tabs, so the fields are
+			//taken from the end of the line
+			std::vector<std::string> field;
+			size_t end = line.size();
+			for (size_t i = 0; i < 8; i++)
+			{
+				size_t tab = end > 0 ? line.rfind('\t', end - 1) : std::string::npos;
+				if (tab == std::string::npos)
+				{
+					throw std::runtime_error(("Malformed line in " + fileName + ": " + line).c_str());
+				}
+
+				field.push_back(line.substr(tab + 1, end - tab - 1));
+				end = tab;
+			}
+
+			size_t chr;
+			std::string description = line.substr(0, end);
+			if (!storage_.FindChr(description, chr))
+			{
+				throw std::runtime_error(("The sequence " + description + " from " + fileName + " is not among the input sequences").c_str());
+			}
+
+			int64_t id = 0;
+			size_t start = 0;
+			size_t finish = 0;
+			std::stringstream ss(field[5] + ' ' + field[4] + ' ' + field[0].substr(field[0].find('=') + 1));
+			if (field[0].compare(0, 3, "id=") != 0 || !(ss >> start >> finish >> id) || start == 0)
+			{
+				throw std::runtime_error(("Malformed line in " + fileName + ": " + line).c_str());
+			}
+
+			if (!block.empty() && block.back().GetBlockId() != id)
+			{
+				sink.Consume(block.data(), block.size());
+				block.clear();
+			}
+
+			lastBlockId_ = std::max(lastBlockId_, id);
+			block.push_back(BlockInstance(field[2] == "-" ? -id : id, chr, start - 1, finish));
+		}
+
+		if (!block.empty())
+		{
+			sink.Consume(block.data(), block.size());
+		}
 	}
 
-	void BlocksFinder::ListChrs(std::ostream & out) const
+	//The cost of sweeping a chromosome is estimated from the number of later
+	//occurrences of its vertices, since the sweep follows the occurrences of a
+	//vertex only forward. The count is scaled by the share of the junctions
+	//that belong to the partner genomes of the chromosome. A chromosome with a
+	//large share of the total cost is split into several parts, and with
+	//several threads the costliest tasks are dispatched first
+	template<class Width>
+	void BlocksFinder<Width>::ScheduleTasks(int32_t threads)
 	{
-		out << "Seq_id\tSize\tDescription" << std::endl;
+		std::vector<size_t> partnerEnd;
+		GetPartners(partnerEnd);
+		size_t genomes = partnerEnd.size();
+		double totalJunctions = 0;
+		std::vector<double> genomeJunctions(genomes, 0);
 		for (size_t i = 0; i < storage_.GetChrNumber(); i++)
 		{
-			out << i + 1 << '\t' << storage_.GeChrSequenceSize(i) << '\t' << storage_.GetChrDescription(i) << std::endl;
+			genomeJunctions[storage_.GetChrGenome(i)] += storage_.GeChrSize(i);
+			totalJunctions += storage_.GeChrSize(i);
 		}
 
-		out << DELIMITER << std::endl;
-	}
+		std::vector<double> partnerShare(genomes, 0);
+		for (size_t g = 0; g < genomes; g++)
+		{
+			for (size_t h = 0; h < genomes; h++)
+			{
+				partnerShare[g] += genomePartner_[g][h] && totalJunctions > 0 ? genomeJunctions[h] / totalJunctions : 0;
+			}
+		}
 
+		std::vector<uint32_t> occurrence(storage_.GetMaxVertexId() + 1, 0);
+		#pragma omp parallel for num_threads(threads) schedule(dynamic)
+		for (int64_t i = 0; i < int64_t(storage_.GetChrNumber()); i++)
+		{
+			for (size_t j = 0; j < storage_.GeChrSize(i); j++)
+			{
+				#pragma omp atomic
+				occurrence[abs(storage_.GetVertexId(i, j))]++;
+			}
+		}
 
-	void BlocksFinder::ListBlocksIndices(const BlockList & block, const std::string & fileName) const
-	{
-		std::ofstream out;
-		TryOpenFile(fileName, out);
-		ListChrs(out);
-		OutputBlocks(block, out);
-	}
+		double totalCost = 0;
+		std::vector<double> cost(storage_.GetChrNumber(), 0);
+		#pragma omp parallel for num_threads(threads) schedule(dynamic) reduction(+:totalCost)
+		for (int64_t i = 0; i < int64_t(storage_.GetChrNumber()); i++)
+		{
+			for (size_t j = 0; j < storage_.GeChrSize(i); j++)
+			{
+				cost[i] += occurrence[abs(storage_.GetVertexId(i, j))] - storage_.GetPointerIndex(i, j) - 1;
+			}
 
-	std::string BlocksFinder::OutputIndex(const BlockInstance & block) const
-	{
-		std::stringstream out;
-		out << block.GetChrId() + 1 << '\t' << (block.GetSignedBlockId() < 0 ? '-' : '+') << '\t';
-		out << block.GetConventionalStart() << '\t' << block.GetConventionalEnd() << '\t' << block.GetEnd() - block.GetStart();
-		return out.str();
+			cost[i] *= partnerShare[storage_.GetChrGenome(i)];
+			totalCost += cost[i];
+		}
+
+		task_.clear();
+		for (size_t i = 0; i < storage_.GetChrNumber(); i++)
+		{
+			size_t genome = storage_.GetChrGenome(i);
+			size_t end = partnerEnd[genome];
+			if (storage_.IsChrSorted())
+			{
+				end = end > i ? end : 0;
+			}
+
+			//A sweep without later occurrences enumerates no pairs
+			if (end == 0 || cost[i] == 0)
+			{
+				continue;
+			}
+
+			size_t parts = totalCost > 0 ? size_t(std::ceil(cost[i] * threads / totalCost)) : 1;
+			parts = std::max(size_t(1), std::min(parts, storage_.GetChrNumber() * 2));
+			for (size_t part = 0; part < parts; part++)
+			{
+				task_.push_back(SweepTask(i, part, parts, end, cost[i] / parts));
+			}
+		}
+
+		if (threads > 1)
+		{
+			std::stable_sort(task_.begin(), task_.end(), [](const SweepTask & a, const SweepTask & b) { return a.cost > b.cost; });
+		}
 	}
 
-	void BlocksFinder::OutputBlocks(const std::vector<BlockInstance>& block, std::ofstream& out) const
+	//Marks for every genome the genomes its pairs are mapped with. For every
+	//genome partnerEnd gets the end of the chromosome range the sweeps of its
+	//chromosomes have to follow the occurrences to: past the last chromosome
+	//of an allowed genome, or all chromosomes if they are not sorted. Zero
+	//means that no allowed pair exists
+	template<class Width>
+	void BlocksFinder<Width>::GetPartners(std::vector<size_t> & partnerEnd)
 	{
-		std::vector<IndexPair> group;
-		std::vector<BlockInstance> blockList = block;
-		GroupBy(blockList, compareById, std::back_inserter(group));
-		for (std::vector<IndexPair>::iterator it = group.begin(); it != group.end(); ++it)
+		size_t genomes = 0;
+		for (size_t i = 0; i < storage_.GetChrNumber(); i++)
+		{
+			genomes = std::max(genomes, storage_.GetChrGenome(i) + 1);
+		}
+
+		std::vector<size_t> genomeEnd(genomes, 0);
+		for (size_t i = 0; i < storage_.GetChrNumber(); i++)
+		{
+			genomeEnd[storage_.GetChrGenome(i)] = storage_.IsChrSorted() ? i + 1 : storage_.GetChrNumber();
+		}
+
+		partnerEnd.assign(genomes, 0);
+		genomePartner_.assign(genomes, std::vector<char>(genomes, 0));
+		for (size_t g = 0; g < genomes; g++)
 		{
-			size_t length = it->second - it->first;
-			std::sort(blockList.begin() + it->first, blockList.begin() + it->second, compareByChrId);
-			out << "Block #" << blockList[it->first].GetBlockId() << std::endl;
-			out << "Seq_id\tStrand\tStart\tEnd\tLength" << std::endl;
-			for (auto jt = blockList.begin() + it->first; jt < blockList.begin() + it->first + length; ++jt)
+			for (size_t h = 0; h < genomes; h++)
 			{
-				out << OutputIndex(*jt) << std::endl;
+				genomePartner_[g][h] = pairs_.Allowed(g, h);
+				if (genomePartner_[g][h])
+				{
+					partnerEnd[g] = std::max(partnerEnd[g], genomeEnd[h]);
+				}
 			}
+		}
+	}
 
-			out << DELIMITER << std::endl;
+	template<class Width>
+	void BlocksFinder<Width>::ListSweepCosts(const std::string & fileName) const
+	{
+		std::ofstream out;
+		TryOpenFile(fileName, out);
+		std::vector<SweepTask> chrTask;
+		for (size_t i = 0; i < storage_.GetChrNumber(); i++)
+		{
+			chrTask.push_back(SweepTask(i, 0, 0, 0, 0));
+		}
+
+		for (const SweepTask & task : task_)
+		{
+			chrTask[task.chr].parts++;
+			chrTask[task.chr].cost += task.cost;
+			chrTask[task.chr].time += task.time;
+		}
+
+		std::stable_sort(chrTask.begin(), chrTask.end(), [](const SweepTask & a, const SweepTask & b) { return a.cost > b.cost; });
+		out << "Seq_id\tParts\tPredicted_cost\tActual_seconds" << std::endl;
+		for (const SweepTask & task : chrTask)
+		{
+			out << task.chr + 1 << '\t' << task.parts << '\t' << uint64_t(task.cost) << '\t' << task.time << std::endl;
 		}
 	}
 
-	void BlocksFinder::ListBlocksIndicesGFF(const BlockList & blockList, const std::string & fileName) const
+	template<class Width>
+	void BlocksFinder<Width>::ListStats(const std::string & fileName) const
 	{
 		std::ofstream out;
 		TryOpenFile(fileName, out);
-		BlockList block(blockList);
-		std::sort(block.begin(), block.end(), compareById);
-		const std::string header[] =
+		const std::pair<std::string, uint64_t> counter[] =
 		{
-			"##gff-version 2",
-			std::string("##source-version BubbZ ") + VERSION,
-			"##Type DNA"
+			std::make_pair("pairs", stats_.pairs),
+			std::make_pair("exact_hits", stats_.exactHits),
+			std::make_pair("best_searches", stats_.bestSearches),
+			std::make_pair("best_hits", stats_.bestHits),
+			std::make_pair("bitmap_words_scanned", stats_.wordsScanned),
+			std::make_pair("entry_lookups", stats_.lookups),
+			std::make_pair("entry_lookup_misses", stats_.lookupMisses),
+			std::make_pair("blocks_reported", stats_.blocksReported),
+			std::make_pair("chains_filtered", stats_.chainsFiltered),
+			std::make_pair("peak_purge_depth", stats_.peakPurge)
 		};
 
-		out << Join(header, header + 3, "\n") << std::endl;
-		for (BlockList::const_iterator it = block.begin(); it != block.end(); ++it)
+		out << "{" << std::endl;
+		out << "\t\"version\": \"" << VERSION << "\"," << std::endl;
+		out << "\t\"threads\": " << threads_ << "," << std::endl;
+		out << "\t\"sequences\": " << storage_.GetChrNumber() << "," << std::endl;
+		out << "\t\"blocks\": " << blocksFound_ << "," << std::endl;
+		out << "\t\"counters\": {";
+		for (size_t i = 0; i < sizeof(counter) / sizeof(counter[0]); i++)
+		{
+			out << (i > 0 ? "," : "") << std::endl << "\t\t\"" << counter[i].first << "\": " << counter[i].second;
+		}
+
+		out << std::endl << "\t}," << std::endl << "\t\"seconds\": {";
+		for (size_t i = 0; i < phaseTime_.size(); i++)
 		{
-			size_t start = it->GetStart() + 1;
-			size_t end = it->GetEnd();
-			out << storage_.GetChrDescription(it->GetChrId()) << "\t" <<
-				"." << "\t" <<
-				"." << "\t" <<
-				start << "\t" <<
-				end << "\t" <<
-				"." << "\t" <<
-				(it->GetDirection() ? "+" : "-") << "\t" <<
-				"." << "\t" <<
-				"id=" << it->GetBlockId() <<
-				"\n";
+			out << (i > 0 ? "," : "") << std::endl << "\t\t\"" << phaseTime_[i].first << "\": " << phaseTime_[i].second;
 		}
+
+		out << std::endl << "\t}," << std::endl << "\t\"memory_bytes\": {";
+		for (auto it = memoryUsage_.begin(); it != memoryUsage_.end(); ++it)
+		{
+			out << (it != memoryUsage_.begin() ? "," : "") << std::endl << "\t\t\"" << it->first << "\": " << it->second;
+		}
+
+		out << std::endl << "\t}," << std::endl;
+		out << "\t\"spilled_bytes\": " << (spool_ ? spool_->GetSpilledBytes() : 0) << std::endl;
+		out << "}" << std::endl;
 	}
 
-	void BlocksFinder::TryOpenFile(const std::string & fileName, std::ofstream & stream) const
+	template<class Width>
+	void BlocksFinder<Width>::TryOpenFile(const std::string & fileName, std::ofstream & stream, bool binary) const
 	{
-		stream.open(fileName.c_str());
+		stream.open(fileName.c_str(), binary ? std::ios::out | std::ios::binary : std::ios::out);
 		if (!stream)
 		{
 			throw std::runtime_error(("Cannot open file " + fileName).c_str());
 		}
 	}
+
+	template class BlocksFinder<NarrowWidth>;
+	template class BlocksFinder<WideWidth>;
 }
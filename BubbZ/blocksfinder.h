@@ -6,6 +6,7 @@
 #include <set>
 #include <map>
 #include <list>
+#include <cmath>
 #include <ctime>
 #include <queue>
 #include <iterator>
@@ -17,13 +18,11 @@
 #include <unordered_map>
 
 
-#include "sweeper.h"
+#include "blockspool.h"
+#include "blockwriter.h"
 
 namespace Sibelia
 {
-	extern const std::string DELIMITER;
-	extern const std::string VERSION;
-
 	namespace
 	{
 		const bool COVERED = true;
@@ -149,15 +148,40 @@ namespace Sibelia
 
 	void CreateOutDirectory(const std::string & path);
 
+	template<class Width>
 	class BlocksFinder
 	{
 	public:
+		typedef Sibelia::Sweeper<Width> Sweeper;
+		typedef Sibelia::VertexEntry<Width> VertexEntry;
+		typedef Sibelia::InstanceSet<Width> InstanceSet;
+		typedef Sibelia::SweepArena<Width> SweepArena;
+		typedef Sibelia::JunctionStorage<Width> JunctionStorage;
 
-		BlocksFinder(JunctionStorage & storage, size_t k) : storage_(storage), k_(k)
+		BlocksFinder(JunctionStorage & storage, size_t k, bool showProgress = true) : storage_(storage), k_(k), showProgress_(showProgress), lastBlockId_(0), threads_(1)
 		{
 			progressCount_ = 50;
 		}
 
+		//Adds the blocks of a previous run from its GFF output. They are passed
+		//to the sink with their ids, and the blocks found later are numbered
+		//after them
+		void LoadBlocks(const std::string & fileName)
+		{
+			previousBlocksFileName_ = fileName;
+		}
+
+		void SetGenomePairs(const GenomePairs & pairs)
+		{
+			pairs_ = pairs;
+		}
+
+		//The input files the block sequences are extracted from
+		void SetSequenceFiles(const std::vector<std::string> & genomesFileName)
+		{
+			genomesFileName_ = genomesFileName;
+		}
+
 		void Split(std::string & source, std::vector<std::string> & result)
 		{
 			std::stringstream ss;
@@ -169,89 +193,117 @@ namespace Sibelia
 			}
 		}
 
-		void FindBlocks(int32_t minBlockSize, int32_t maxBranchSize, int32_t threads, const std::string & debugOut)
+		//Keeps the blocks for GenerateOutput. They are spilled to temporary
+		//files in tmpDir, so the memory used does not depend on their number
+		void FindBlocks(int32_t minBlockSize, int32_t maxBranchSize, int32_t threads, const std::string & tmpDir)
 		{
-			blocksFound_ = 0;
+			CreateOutDirectory(tmpDir);
+			spool_.reset(new BlockSpool(tmpDir, threads));
+			FindBlocks(minBlockSize, maxBranchSize, threads, *spool_);
+			double start = omp_get_wtime();
+			spool_->Finish();
+			AddPhaseTime("merge_runs", omp_get_wtime() - start);
+			AddMemoryUsage("spool_buffers", spool_->GetMemoryUsage());
+		}
+
+		void FindBlocks(int32_t minBlockSize, int32_t maxBranchSize, int32_t threads, BlockSink & sink)
+		{
+			double start = omp_get_wtime();
+			if (!previousBlocksFileName_.empty())
+			{
+				ReadBlocks(previousBlocksFileName_, sink);
+				AddPhaseTime("previous_blocks", omp_get_wtime() - start);
+			}
+
+			blocksFound_ = lastBlockId_;
+			threads_ = threads;
 			minBlockSize_ = minBlockSize;
 			maxBranchSize_ = maxBranchSize;
 
 			using namespace std::placeholders;
 
 			count_ = 0;
-			time_t start = clock();
 			currentIndex_ = 0;
-			workInstance_.resize(threads);
+			stats_ = SweepStats();
+			memoryUsage_.clear();
+			AddMemoryUsage("junctions", storage_.GetMemoryUsage());
+
+			if (showProgress_)
+			{
+				std::cout << '[' << std::flush;
+			}
 
-			std::cout << '[' << std::flush;
-			progressPortion_ = storage_.GetChrNumber() / progressCount_;
+			start = omp_get_wtime();
+			ScheduleTasks(threads);
+			AddPhaseTime("schedule", omp_get_wtime() - start);
+			progressPortion_ = task_.size() / progressCount_;
 			if (progressPortion_ == 0)
 			{
 				progressPortion_ = 1;
 			}
 
+			start = omp_get_wtime();
 			#pragma omp parallel num_threads(threads)
 			{
-				ChrSweep process(*this);
+				ChrSweep process(*this, sink);
 				process();
 			}
 
-			for (auto & outVector : workInstance_)
+			AddPhaseTime("sweep", omp_get_wtime() - start);
+			if (showProgress_)
 			{
-				std::copy(outVector.begin(), outVector.end(), std::back_inserter(blocksInstance_));
-				outVector.clear();
+				std::cout << ']' << std::endl;
 			}
+		}
 
-			std::cout << ']' << std::endl;
-
-			//std::cout << double(clock() - start) / CLOCKS_PER_SEC << std::endl;
+		//The phases are listed in the statistics in the order they are added
+		void AddPhaseTime(const std::string & phase, double seconds)
+		{
+			phaseTime_.push_back(std::make_pair(phase, seconds));
 		}
 
 		struct ChrSweep
 		{
 		public:
 			BlocksFinder & finder;
+			BlockSink & sink;
 
-			ChrSweep(BlocksFinder & finder) : finder(finder)
+			ChrSweep(BlocksFinder & finder, BlockSink & sink) : finder(finder), sink(sink)
 			{
 			}
 
 			void operator()() const
 			{
+				BitmapPool pool;
+				typename InstanceSet::DirtyList dirty;
+				SweepArena arena(finder.maxBranchSize_, finder.storage_.GetAbundance());
 				std::vector<std::vector<InstanceSet > > instance(2, std::vector<InstanceSet>(finder.storage_.GetChrNumber()));
 				for (size_t i = 0; i < 2; i++)
 				{
 					for (size_t j = 0; j < finder.storage_.GetChrNumber(); j++)
 					{
-						instance[i][j].Init(j, i == 0, finder.storage_.GeChrSize(j));
+						instance[i][j].Init(j, i == 0, finder.storage_.GeChrSize(j), pool, dirty, arena.stats);
 					}
 				}
 
-				std::vector<VertexEntry* > lastPosEntry_(finder.storage_.GetMaxVertexId() + 1, 0);
-				std::vector<VertexEntry* > lastNegEntry_(finder.storage_.GetMaxVertexId() + 1, 0);
-
-				size_t endIndex = finder.storage_.GetChrNumber();
+				size_t endIndex = finder.task_.size();
 				for(bool go = true; go;)
 				{
-					size_t nowChr;
-					#pragma omp critical
-					{
-						if (finder.currentIndex_ < endIndex)
-						{
-							nowChr = finder.currentIndex_++;
-						}
-						else
-						{
-							go = false;
-						}
-					}
-
+					size_t nowTask = finder.currentIndex_++;
+					go = nowTask < endIndex;
 					if (go)
 					{
-						auto it = JunctionStorage::Iterator(nowChr);
-						Sweeper sweeper(it, lastPosEntry_, lastNegEntry_);
-						sweeper.Sweep(finder.storage_, finder.minBlockSize_, finder.maxBranchSize_, finder.k_, finder.blocksFound_, finder.workInstance_[omp_get_thread_num()], instance);
+						const SweepTask & task = finder.task_[nowTask];
+						const auto & partner = finder.genomePartner_[finder.storage_.GetChrGenome(task.chr)];
+						auto it = typename JunctionStorage::Iterator(finder.storage_, task.chr);
+						Sweeper sweeper(it, arena, partner, task.partnerEnd, task.part, task.parts);
+						double start = omp_get_wtime();
+						sweeper.Sweep(finder.storage_, finder.minBlockSize_, finder.maxBranchSize_, finder.k_, finder.blocksFound_, sink, instance);
+						InstanceSet::Reset(dirty);
+						finder.task_[nowTask].time = omp_get_wtime() - start;
+
 						{
-							if (finder.count_++ % finder.progressPortion_ == 0)
+							if (finder.count_++ % finder.progressPortion_ == 0 && finder.showProgress_)
 							{
 								std::cout << '.' << std::flush;
 							}
@@ -259,26 +311,97 @@ namespace Sibelia
 					}
 					
 				}
+
+				size_t instanceSetMemory = 0;
+				for (auto & strand : instance)
+				{
+					for (auto & set : strand)
+					{
+						instanceSetMemory += set.GetMemoryUsage() + sizeof(set);
+					}
+				}
+
+				#pragma omp critical
+				{
+					finder.stats_.Add(arena.stats);
+					finder.AddMemoryUsage("sweep_arenas", arena.GetMemoryUsage());
+					finder.AddMemoryUsage("bitmap_pages", pool.GetMemoryUsage());
+					finder.AddMemoryUsage("instance_sets", instanceSetMemory);
+				}
 			}
 		};
 		
 
-		void GenerateOutput(const std::string & outDir, bool genSeq, bool legacyOut)
+		//Writes the blocks in the format into outDir, or into out if it is set
+		void GenerateOutput(const std::string & outDir, bool genSeq, bool legacyOut, const std::string & format = "gff", std::ostream * out = 0, bool align = false)
 		{
-			const auto & trimmedBlocks = blocksInstance_;
-
 			std::cout.setf(std::cout.fixed);
 			std::cout.precision(2);
 			std::cout << "Blocks found: " << blocksFound_ << std::endl;
+			if (!spool_)
+			{
+				throw std::runtime_error("The blocks must be found before generating the output");
+			}
 
 			CreateOutDirectory(outDir);
-			std::string blocksDir = outDir + "/blocks";
-			ListBlocksIndicesGFF(trimmedBlocks, outDir + "/" + "blocks_coords.gff");
+			double start = omp_get_wtime();
+			std::vector<SequenceInfo> sequence;
+			for (size_t i = 0; i < storage_.GetChrNumber(); i++)
+			{
+				sequence.push_back(SequenceInfo(storage_.GetChrDescription(i), storage_.GeChrSequenceSize(i)));
+			}
+
+			if (out != 0)
+			{
+				std::unique_ptr<BlockWriter> writer(CreateBlockWriter(format, *out, sequence));
+				WriteBlocks(*writer);
+				out->flush();
+			}
+			else
+			{
+				std::ofstream file;
+				TryOpenFile(outDir + "/" + GetBlocksFileName(format), file, format == "binary");
+				std::unique_ptr<BlockWriter> writer(CreateBlockWriter(format, file, sequence));
+				WriteBlocks(*writer);
+			}
 
 			if (legacyOut)
 			{
-				ListBlocksIndices(trimmedBlocks, outDir + "/" + "blocks_coords.txt");
+				std::ofstream file;
+				TryOpenFile(outDir + "/" + GetBlocksFileName("legacy"), file);
+				LegacyWriter writer(file, sequence);
+				WriteBlocks(writer);
 			}
+
+			if (genSeq || align)
+			{
+				GenomeSequences genome(genomesFileName_, threads_);
+				if (!genome.Matches(sequence))
+				{
+					throw std::runtime_error("The input files do not match the sequences of the graph");
+				}
+
+				if (genSeq)
+				{
+					std::ofstream file;
+					TryOpenFile(outDir + "/" + "blocks_sequences.fasta", file);
+					FastaWriter writer(file, sequence, genome);
+					WriteBlocks(writer);
+				}
+
+				//The band covers the gaps allowed within a chain
+				if (align)
+				{
+					std::ofstream file;
+					TryOpenFile(outDir + "/" + "blocks_alignment.paf", file);
+					PafWriter writer(file, sequence, &genome, maxBranchSize_);
+					WriteBlocks(writer);
+				}
+			}
+
+			ListSweepCosts(outDir + "/" + "sweep_costs.txt");
+			AddPhaseTime("output", omp_get_wtime() - start);
+			ListStats(outDir + "/" + "run_stats.json");
 		}
 
 	
@@ -295,6 +418,19 @@ namespace Sibelia
 
 	private:
 
+		static const size_t WRITE_BATCH = 1 << 16;
+
+		struct SweepTask
+		{
+			size_t chr;
+			size_t part;
+			size_t parts;
+			size_t partnerEnd;
+			double cost;
+			double time;
+			SweepTask(size_t chr, size_t part, size_t parts, size_t partnerEnd, double cost) : chr(chr), part(part), parts(parts), partnerEnd(partnerEnd), cost(cost), time(0) {}
+		};
+
 		template<class Iterator>
 		void OutputLines(Iterator start, size_t length, std::ostream & out) const
 		{
@@ -308,27 +444,64 @@ namespace Sibelia
 			}
 		}
 
-		void ListChrs(std::ostream & out) const;
-		std::string OutputIndex(const BlockInstance & block) const;
-		void OutputBlocks(const std::vector<BlockInstance>& block, std::ofstream& out) const;
-		void ListBlocksIndices(const BlockList & block, const std::string & fileName) const;
-		void ListBlocksIndicesGFF(const BlockList & blockList, const std::string & fileName) const;
-		void TryOpenFile(const std::string & fileName, std::ofstream & stream) const;
+		//Passes the merged instances to the writer in batches of whole blocks,
+		//every batch is formatted by all threads
+		void WriteBlocks(BlockWriter & writer) const
+		{
+			std::vector<BlockInstance> batch;
+			size_t batchSize = WRITE_BATCH * threads_;
+			spool_->ForEachSorted([&](const BlockInstance & block)
+			{
+				if (batch.size() >= batchSize && batch.back().GetBlockId() != block.GetBlockId())
+				{
+					writer.Write(batch.data(), batch.size(), threads_);
+					batch.clear();
+				}
+
+				batch.push_back(block);
+			});
+
+			writer.Write(batch.data(), batch.size(), threads_);
+			writer.Finish();
+		}
+
+		void ScheduleTasks(int32_t threads);
+		void GetPartners(std::vector<size_t> & partnerEnd);
+		void ListSweepCosts(const std::string & fileName) const;
+		void ListStats(const std::string & fileName) const;
+		void ReadBlocks(const std::string & fileName, BlockSink & sink);
+		void TryOpenFile(const std::string & fileName, std::ofstream & stream, bool binary = false) const;
 
 
 		int64_t k_;
+		bool showProgress_;
 		size_t progressCount_;
 		size_t progressPortion_;
 		std::atomic<int64_t> count_;
 		std::atomic<size_t> currentIndex_;
 		std::atomic<int64_t> blocksFound_;
+		int64_t lastBlockId_;
+		int32_t threads_;
 
 		int32_t minBlockSize_;
 		int32_t maxBranchSize_;
 		JunctionStorage & storage_;
 		std::ofstream debugOut_;
-		std::vector<BlockInstance> blocksInstance_;
-		std::vector<std::vector<BlockInstance> > workInstance_;
+		GenomePairs pairs_;
+		std::vector<std::string> genomesFileName_;
+		std::vector<SweepTask> task_;
+		std::vector<std::vector<char> > genomePartner_;
+		std::string previousBlocksFileName_;
+		std::unique_ptr<BlockSpool> spool_;
+		SweepStats stats_;
+		std::map<std::string, size_t> memoryUsage_;
+		std::vector<std::pair<std::string, double> > phaseTime_;
+
+		//The sizes of the structures of the threads are added up
+		void AddMemoryUsage(const std::string & structure, size_t bytes)
+		{
+			memoryUsage_[structure] += bytes;
+		}
 
 
 		//std::ofstream forkLog;
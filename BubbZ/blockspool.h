@@ -0,0 +1,291 @@
+#ifndef _BLOCK_SPOOL_H_
+#define _BLOCK_SPOOL_H_
+
+#include <deque>
+#include <mutex>
+#include <queue>
+#include <memory>
+#include <thread>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <condition_variable>
+
+#include "sweeper.h"
+
+namespace Sibelia
+{
+	//A block sink that keeps a bounded number of instances in memory. Every
+	//thread fills its own buffer, a full buffer is sorted by the thread and
+	//handed to a background writer that spills it to disk as a run. Reading
+	//merges the runs, so the instances come out ordered by block id
+	class BlockSpool : public BlockSink
+	{
+	public:
+		static const size_t DEFAULT_RUN_SIZE = 1 << 18;
+
+		BlockSpool(const std::string & tmpDir, size_t threads, size_t runSize = DEFAULT_RUN_SIZE) :
+			tmpDir_(tmpDir), runSize_(std::max(runSize, size_t(1))), maxQueued_(std::max(threads, size_t(1))), runNumber_(0), spilledBytes_(0), maxCapacity_(0), done_(false), buffer_(std::max(threads, size_t(1)))
+		{
+			writer_ = std::thread(&BlockSpool::Write, this);
+		}
+
+		~BlockSpool()
+		{
+			Stop();
+			for (const std::string & fileName : runFileName_)
+			{
+				std::remove(fileName.c_str());
+			}
+		}
+
+		void Consume(const BlockInstance * instance, size_t count)
+		{
+			std::vector<BlockInstance> & buffer = buffer_[omp_get_thread_num()];
+			buffer.insert(buffer.end(), instance, instance + count);
+			if (buffer.size() >= runSize_)
+			{
+				Spill(buffer);
+			}
+		}
+
+		//Spills the remaining buffers and waits for the writer. No instances
+		//can be consumed afterwards
+		void Finish()
+		{
+			for (auto & buffer : buffer_)
+			{
+				if (!buffer.empty())
+				{
+					Spill(buffer);
+				}
+			}
+
+			Stop();
+			if (!error_.empty())
+			{
+				throw std::runtime_error(error_.c_str());
+			}
+
+			//Merges the oldest runs until all of them can be read at once
+			while (runFileName_.size() > MAX_MERGE_RUNS)
+			{
+				std::vector<std::string> merged(runFileName_.begin(), runFileName_.begin() + MAX_MERGE_RUNS);
+				std::string fileName = GetRunFileName(runNumber_++);
+				std::ofstream out(fileName.c_str(), std::ios::binary);
+				runFileName_.erase(runFileName_.begin(), runFileName_.begin() + MAX_MERGE_RUNS);
+				runFileName_.push_back(fileName);
+				Merge(merged, [&](const BlockInstance & block)
+				{
+					out.write(reinterpret_cast<const char*>(&block), sizeof(block));
+				});
+
+				out.close();
+				if (!out)
+				{
+					throw std::runtime_error(("Cannot write the temporary file " + fileName).c_str());
+				}
+
+				for (const std::string & name : merged)
+				{
+					std::remove(name.c_str());
+				}
+			}
+		}
+
+		//The most memory the buffered instances can take: the buffers of the
+		//threads, the queued runs and the run held by the writer
+		size_t GetMemoryUsage() const
+		{
+			return (buffer_.size() + maxQueued_ + 1) * std::max(runSize_, maxCapacity_) * sizeof(BlockInstance);
+		}
+
+		//The size of the runs written by the sweeps, valid after Finish
+		size_t GetSpilledBytes() const
+		{
+			return spilledBytes_;
+		}
+
+		//Calls f for every instance, ordered by block id, chromosome and start
+		template<class F>
+		void ForEachSorted(F f) const
+		{
+			Merge(runFileName_, f);
+		}
+
+	private:
+		static const size_t MAX_MERGE_RUNS = 64;
+
+		BlockSpool(const BlockSpool &);
+		BlockSpool & operator = (const BlockSpool &);
+
+		template<class F>
+		static void Merge(const std::vector<std::string> & runFileName, F f)
+		{
+			typedef std::pair<BlockInstance, size_t> Item;
+			auto greater = [](const Item & a, const Item & b)
+			{
+				return b.first < a.first || (!(a.first < b.first) && b.second < a.second);
+			};
+
+			std::vector<std::unique_ptr<RunReader> > reader;
+			std::priority_queue<Item, std::vector<Item>, decltype(greater)> heap(greater);
+			for (const std::string & fileName : runFileName)
+			{
+				reader.emplace_back(new RunReader(fileName));
+				if (reader.back()->Valid())
+				{
+					heap.push(Item(reader.back()->Get(), reader.size() - 1));
+				}
+			}
+
+			while (!heap.empty())
+			{
+				Item top = heap.top();
+				heap.pop();
+				f(top.first);
+				RunReader & run = *reader[top.second];
+				run.Next();
+				if (run.Valid())
+				{
+					heap.push(Item(run.Get(), top.second));
+				}
+			}
+		}
+
+		class RunReader
+		{
+		public:
+			RunReader(const std::string & fileName) : in_(fileName.c_str(), std::ios::binary), pos_(0)
+			{
+				if (!in_)
+				{
+					throw std::runtime_error(("Cannot open file " + fileName).c_str());
+				}
+
+				Fill();
+			}
+
+			bool Valid() const
+			{
+				return pos_ < chunk_.size();
+			}
+
+			const BlockInstance & Get() const
+			{
+				return chunk_[pos_];
+			}
+
+			void Next()
+			{
+				if (++pos_ == chunk_.size())
+				{
+					Fill();
+				}
+			}
+
+		private:
+			static const size_t READ_CHUNK = 1 << 12;
+			std::ifstream in_;
+			size_t pos_;
+			std::vector<BlockInstance> chunk_;
+
+			void Fill()
+			{
+				chunk_.resize(READ_CHUNK);
+				in_.read(reinterpret_cast<char*>(chunk_.data()), sizeof(BlockInstance) * READ_CHUNK);
+				chunk_.resize(in_.gcount() / sizeof(BlockInstance));
+				pos_ = 0;
+			}
+		};
+
+		std::string tmpDir_;
+		size_t runSize_;
+		size_t maxQueued_;
+		size_t runNumber_;
+		size_t spilledBytes_;
+		size_t maxCapacity_;
+		bool done_;
+		std::string error_;
+		std::thread writer_;
+		std::mutex mutex_;
+		std::condition_variable notFull_;
+		std::condition_variable notEmpty_;
+		std::deque<std::vector<BlockInstance> > queue_;
+		std::vector<std::vector<BlockInstance> > buffer_;
+		std::vector<std::string> runFileName_;
+
+		std::string GetRunFileName(size_t run) const
+		{
+			std::stringstream ss;
+			ss << tmpDir_ << "/blocks_run_" << run << ".tmp";
+			return ss.str();
+		}
+
+		//The buffer keeps its capacity, so it does not grow again from zero
+		void Spill(std::vector<BlockInstance> & buffer)
+		{
+			size_t capacity = buffer.capacity();
+			std::sort(buffer.begin(), buffer.end());
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				notFull_.wait(lock, [this] { return queue_.size() < maxQueued_; });
+				maxCapacity_ = std::max(maxCapacity_, capacity);
+				queue_.push_back(std::move(buffer));
+				notEmpty_.notify_one();
+			}
+
+			buffer.clear();
+			buffer.reserve(capacity);
+		}
+
+		void Stop()
+		{
+			if (writer_.joinable())
+			{
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					done_ = true;
+				}
+
+				notEmpty_.notify_one();
+				writer_.join();
+			}
+		}
+
+		void Write()
+		{
+			for (std::vector<BlockInstance> run; ; run.clear())
+			{
+				{
+					std::unique_lock<std::mutex> lock(mutex_);
+					notEmpty_.wait(lock, [this] { return !queue_.empty() || done_; });
+					if (queue_.empty())
+					{
+						return;
+					}
+
+					run.swap(queue_.front());
+					queue_.pop_front();
+				}
+
+				notFull_.notify_all();
+				std::string fileName = GetRunFileName(runNumber_++);
+				runFileName_.push_back(fileName);
+				spilledBytes_ += sizeof(BlockInstance) * run.size();
+				std::ofstream out(fileName.c_str(), std::ios::binary);
+				out.write(reinterpret_cast<const char*>(run.data()), sizeof(BlockInstance) * run.size());
+				if (!out && error_.empty())
+				{
+					error_ = "Cannot write the temporary file " + fileName;
+				}
+			}
+		}
+	};
+}
+
+#endif
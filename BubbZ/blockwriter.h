@@ -0,0 +1,658 @@
+#ifndef _BLOCK_WRITER_H_
+#define _BLOCK_WRITER_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <ostream>
+#include <istream>
+#include <algorithm>
+#include <stdexcept>
+
+#include <omp.h>
+
+#include <dnachar.h>
+#include <streamfastaparser.h>
+
+#include "sweeper.h"
+#include "fastaindex.h"
+#include "bandedaligner.h"
+
+namespace Sibelia
+{
+	extern const std::string DELIMITER;
+	extern const std::string VERSION;
+
+	struct SequenceInfo
+	{
+		std::string description;
+		uint64_t size;
+
+		SequenceInfo() {}
+		SequenceInfo(const std::string & description, uint64_t size) : description(description), size(size)
+		{
+
+		}
+	};
+
+	inline void AppendInt(std::string & buffer, uint64_t value)
+	{
+		char digit[20];
+		size_t length = 0;
+		do
+		{
+			digit[length++] = char('0' + value % 10);
+			value /= 10;
+		} while (value > 0);
+
+		while (length > 0)
+		{
+			buffer.push_back(digit[--length]);
+		}
+	}
+
+	inline void AppendVarint(std::string & buffer, uint64_t value)
+	{
+		for (; value >= 0x80; value >>= 7)
+		{
+			buffer.push_back(char(value | 0x80));
+		}
+
+		buffer.push_back(char(value));
+	}
+
+	//The input sequences the blocks are extracted from. Files with regular
+	//lines are memory-mapped, only the other ones are loaded into memory
+	class GenomeSequences
+	{
+	public:
+		GenomeSequences(const std::vector<std::string> & genomesFileName, int64_t threads)
+		{
+			std::string error;
+			std::vector<std::vector<Sequence> > fileSequence(genomesFileName.size());
+			indexed_.resize(genomesFileName.size());
+			#pragma omp parallel for schedule(dynamic, 1) num_threads(std::max(threads, int64_t(1)))
+			for (int64_t file = 0; file < int64_t(genomesFileName.size()); file++)
+			{
+				try
+				{
+					indexed_[file].reset(new IndexedFasta(genomesFileName[file]));
+					if (indexed_[file]->Valid())
+					{
+						for (size_t i = 0; i < indexed_[file]->GetRecordNumber(); i++)
+						{
+							fileSequence[file].push_back(Sequence(indexed_[file]->GetRecord(i).description, indexed_[file].get(), i));
+						}
+					}
+					else
+					{
+						indexed_[file].reset();
+						for (TwoPaCo::StreamFastaParser parser(genomesFileName[file]); parser.ReadRecord(); )
+						{
+							fileSequence[file].push_back(Sequence(parser.GetCurrentHeader(), 0, 0));
+							for (char ch; parser.GetChar(ch); )
+							{
+								fileSequence[file].back().data.push_back(ch);
+							}
+						}
+					}
+				}
+				catch (std::exception & e)
+				{
+					#pragma omp critical
+					{
+						error = e.what();
+					}
+				}
+			}
+
+			if (!error.empty())
+			{
+				throw std::runtime_error(error.c_str());
+			}
+
+			for (auto & file : fileSequence)
+			{
+				for (auto & sequence : file)
+				{
+					sequence_.push_back(Sequence());
+					std::swap(sequence_.back(), sequence);
+				}
+			}
+		}
+
+		//Checks that the sequences are the ones the blocks refer to
+		bool Matches(const std::vector<SequenceInfo> & sequence) const
+		{
+			if (sequence.size() != sequence_.size())
+			{
+				return false;
+			}
+
+			for (size_t i = 0; i < sequence.size(); i++)
+			{
+				if (sequence[i].description != sequence_[i].description)
+				{
+					return false;
+				}
+			}
+
+			return true;
+		}
+
+		//Appends the instance, reverse complemented on the negative strand
+		void Append(const BlockInstance & instance, std::string & buffer) const
+		{
+			size_t start = buffer.size();
+			const Sequence & sequence = sequence_[instance.GetChrId()];
+			if (sequence.indexed != 0)
+			{
+				sequence.indexed->AppendSequence(sequence.record, instance.GetStart(), instance.GetEnd(), buffer);
+			}
+			else if (instance.GetStart() < sequence.data.size())
+			{
+				buffer.append(sequence.data, instance.GetStart(), instance.GetLength());
+			}
+
+			if (!instance.GetDirection())
+			{
+				std::reverse(buffer.begin() + start, buffer.end());
+				for (size_t i = start; i < buffer.size(); i++)
+				{
+					buffer[i] = TwoPaCo::DnaChar::ReverseChar(buffer[i]);
+				}
+			}
+		}
+
+	private:
+		GenomeSequences(const GenomeSequences &);
+		GenomeSequences & operator = (const GenomeSequences &);
+
+		struct Sequence
+		{
+			std::string description;
+			const IndexedFasta * indexed;
+			size_t record;
+			std::string data;
+
+			Sequence() : indexed(0), record(0) {}
+			Sequence(const std::string & description, const IndexedFasta * indexed, size_t record) : description(description), indexed(indexed), record(record)
+			{
+
+			}
+		};
+
+		std::vector<Sequence> sequence_;
+		std::vector<std::unique_ptr<IndexedFasta> > indexed_;
+	};
+
+	//Writes the blocks in one of the output formats. The instances are passed
+	//as whole blocks sorted by block id, and by chromosome and start within a
+	//block. A batch of blocks is split between the threads, every thread
+	//formats its part into its own buffer and the buffers are written in order
+	class BlockWriter
+	{
+	public:
+		BlockWriter(std::ostream & out, const std::vector<SequenceInfo> & sequence) : out_(out), sequence_(sequence), lastId_(0)
+		{
+
+		}
+
+		virtual ~BlockWriter()
+		{
+
+		}
+
+		void Write(const BlockInstance * block, size_t count, size_t threads = 1)
+		{
+			if (count == 0)
+			{
+				return;
+			}
+
+			//The parts are cut at the block boundaries
+			threads = std::max(size_t(1), std::min(threads, count));
+			std::vector<size_t> bound(threads + 1, count);
+			bound[0] = 0;
+			for (size_t i = 1; i < threads; i++)
+			{
+				size_t pos = std::max(bound[i - 1], count / threads * i);
+				for (; pos > 0 && pos < count && block[pos].GetBlockId() == block[pos - 1].GetBlockId(); pos++);
+				bound[i] = pos;
+			}
+
+			buffer_.resize(threads);
+			Reserve(threads);
+			#pragma omp parallel for num_threads(threads) schedule(static, 1)
+			for (int64_t i = 0; i < int64_t(threads); i++)
+			{
+				buffer_[i].clear();
+				if (bound[i] < bound[i + 1])
+				{
+					Format(block + bound[i], bound[i + 1] - bound[i], bound[i] == 0 ? lastId_ : block[bound[i] - 1].GetBlockId(), buffer_[i]);
+				}
+			}
+
+			for (const std::string & buffer : buffer_)
+			{
+				out_.write(buffer.data(), buffer.size());
+			}
+
+			lastId_ = block[count - 1].GetBlockId();
+		}
+
+		//Must be called after the last block
+		virtual void Finish()
+		{
+
+		}
+
+	protected:
+		std::ostream & out_;
+		const std::vector<SequenceInfo> & sequence_;
+
+		//Prepares the state of the threads formatting a batch
+		virtual void Reserve(size_t)
+		{
+
+		}
+
+		//Formats whole blocks, previousId is the id of the block written before
+		virtual void Format(const BlockInstance * block, size_t count, int64_t previousId, std::string & buffer) const = 0;
+
+		static size_t BlockEnd(const BlockInstance * block, size_t count, size_t start)
+		{
+			size_t end = start + 1;
+			for (; end < count && block[end].GetBlockId() == block[start].GetBlockId(); end++);
+			return end;
+		}
+
+	private:
+		int64_t lastId_;
+		std::vector<std::string> buffer_;
+	};
+
+	class GffWriter : public BlockWriter
+	{
+	public:
+		GffWriter(std::ostream & out, const std::vector<SequenceInfo> & sequence) : BlockWriter(out, sequence)
+		{
+			out_ << "##gff-version 2" << '\n' << "##source-version BubbZ " << VERSION << '\n' << "##Type DNA" << std::endl;
+		}
+
+	protected:
+		void Format(const BlockInstance * block, size_t count, int64_t, std::string & buffer) const
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				buffer += sequence_[block[i].GetChrId()].description;
+				buffer += "\t.\t.\t";
+				AppendInt(buffer, block[i].GetStart() + 1);
+				buffer.push_back('\t');
+				AppendInt(buffer, block[i].GetEnd());
+				buffer += block[i].GetDirection() ? "\t.\t+\t.\tid=" : "\t.\t-\t.\tid=";
+				AppendInt(buffer, block[i].GetBlockId());
+				buffer.push_back('\n');
+			}
+		}
+	};
+
+	class LegacyWriter : public BlockWriter
+	{
+	public:
+		LegacyWriter(std::ostream & out, const std::vector<SequenceInfo> & sequence) : BlockWriter(out, sequence)
+		{
+			out_ << "Seq_id\tSize\tDescription" << std::endl;
+			for (size_t i = 0; i < sequence_.size(); i++)
+			{
+				out_ << i + 1 << '\t' << sequence_[i].size << '\t' << sequence_[i].description << std::endl;
+			}
+
+			out_ << DELIMITER << std::endl;
+		}
+
+	protected:
+		void Format(const BlockInstance * block, size_t count, int64_t, std::string & buffer) const
+		{
+			for (size_t start = 0, end = 0; start < count; start = end)
+			{
+				end = BlockEnd(block, count, start);
+				buffer += "Block #";
+				AppendInt(buffer, block[start].GetBlockId());
+				buffer += "\nSeq_id\tStrand\tStart\tEnd\tLength\n";
+				for (size_t i = start; i < end; i++)
+				{
+					AppendInt(buffer, block[i].GetChrId() + 1);
+					buffer += block[i].GetSignedBlockId() < 0 ? "\t-\t" : "\t+\t";
+					AppendInt(buffer, block[i].GetConventionalStart());
+					buffer.push_back('\t');
+					AppendInt(buffer, block[i].GetConventionalEnd());
+					buffer.push_back('\t');
+					AppendInt(buffer, block[i].GetLength());
+					buffer.push_back('\n');
+				}
+
+				buffer += DELIMITER;
+				buffer.push_back('\n');
+			}
+		}
+	};
+
+	//Writes every pair of instances of a block as a PAF record. Without the
+	//sequences the number of matching bases is not known and is reported as 0,
+	//with them every pair is aligned and the CIGAR is added in the cg tag
+	class PafWriter : public BlockWriter
+	{
+	public:
+		PafWriter(std::ostream & out, const std::vector<SequenceInfo> & sequence, const GenomeSequences * genome = 0, size_t band = 0) : BlockWriter(out, sequence), genome_(genome), band_(band)
+		{
+
+		}
+
+	protected:
+		//Every thread keeps its aligner and its buffers across the batches
+		void Reserve(size_t threads)
+		{
+			if (aligner_.size() < threads)
+			{
+				aligner_.resize(threads, BandedAligner(band_));
+			}
+		}
+
+		void Format(const BlockInstance * block, size_t count, int64_t, std::string & buffer) const
+		{
+			BandedAligner & aligner = aligner_[omp_get_thread_num()];
+			for (size_t start = 0, end = 0; start < count; start = end)
+			{
+				end = BlockEnd(block, count, start);
+				for (size_t i = start; i < end; i++)
+				{
+					for (size_t j = i + 1; j < end; j++)
+					{
+						AppendRecord(block[i], block[j], aligner, buffer);
+					}
+				}
+			}
+		}
+
+	private:
+		const GenomeSequences * genome_;
+		size_t band_;
+		mutable std::vector<BandedAligner> aligner_;
+
+		//The target is aligned on the positive strand, the query on the strand
+		//relative to it
+		void AppendRecord(const BlockInstance & query, const BlockInstance & target, BandedAligner & aligner, std::string & buffer) const
+		{
+			bool positive = query.GetDirection() == target.GetDirection();
+			AppendSequence(query, buffer);
+			buffer += positive ? "+\t" : "-\t";
+			AppendSequence(target, buffer);
+			if (genome_ != 0)
+			{
+				BandedAligner::Result result;
+				std::string querySequence;
+				std::string targetSequence;
+				int64_t id = query.GetBlockId();
+				genome_->Append(BlockInstance(positive ? id : -id, query.GetChrId(), query.GetStart(), query.GetEnd()), querySequence);
+				genome_->Append(BlockInstance(id, target.GetChrId(), target.GetStart(), target.GetEnd()), targetSequence);
+				aligner.Align(querySequence, targetSequence, result);
+				AppendInt(buffer, result.matches);
+				buffer.push_back('\t');
+				AppendInt(buffer, result.columns);
+				buffer += "\t255\tid:i:";
+				AppendInt(buffer, id);
+				buffer += "\tcg:Z:";
+				buffer += result.cigar;
+			}
+			else
+			{
+				buffer += "0\t";
+				AppendInt(buffer, std::max(query.GetLength(), target.GetLength()));
+				buffer += "\t255\tid:i:";
+				AppendInt(buffer, query.GetBlockId());
+			}
+
+			buffer.push_back('\n');
+		}
+
+		void AppendSequence(const BlockInstance & instance, std::string & buffer) const
+		{
+			const SequenceInfo & info = sequence_[instance.GetChrId()];
+			buffer += info.description;
+			buffer.push_back('\t');
+			AppendInt(buffer, info.size);
+			buffer.push_back('\t');
+			AppendInt(buffer, instance.GetStart());
+			buffer.push_back('\t');
+			AppendInt(buffer, instance.GetEnd());
+			buffer.push_back('\t');
+		}
+	};
+
+	//A compact binary format. The header lists the sequences, then every block
+	//is written as the difference of its id to the previous one followed by the
+	//number of instances. An instance is its chromosome relative to the previous
+	//instance, its start relative to the previous start on the same chromosome
+	//and its length with the strand in the lowest bit. All numbers are varints,
+	//and a zero id difference ends the file
+	class BinaryWriter : public BlockWriter
+	{
+	public:
+		static const uint64_t MAGIC = 0x314b4c425a425542ULL;
+
+		BinaryWriter(std::ostream & out, const std::vector<SequenceInfo> & sequence) : BlockWriter(out, sequence)
+		{
+			uint64_t magic = MAGIC;
+			std::string header(reinterpret_cast<const char*>(&magic), sizeof(magic));
+			AppendVarint(header, sequence_.size());
+			for (const SequenceInfo & info : sequence_)
+			{
+				AppendVarint(header, info.description.size());
+				header += info.description;
+				AppendVarint(header, info.size);
+			}
+
+			out_.write(header.data(), header.size());
+		}
+
+		void Finish()
+		{
+			out_.put(0);
+			out_.flush();
+		}
+
+	protected:
+		void Format(const BlockInstance * block, size_t count, int64_t previousId, std::string & buffer) const
+		{
+			for (size_t start = 0, end = 0; start < count; start = end)
+			{
+				size_t chr = 0;
+				size_t position = 0;
+				end = BlockEnd(block, count, start);
+				AppendVarint(buffer, block[start].GetBlockId() - previousId);
+				AppendVarint(buffer, end - start);
+				for (size_t i = start; i < end; i++)
+				{
+					AppendVarint(buffer, block[i].GetChrId() - chr);
+					AppendVarint(buffer, block[i].GetStart() - (block[i].GetChrId() == chr ? position : 0));
+					AppendVarint(buffer, (block[i].GetLength() << 1) | (block[i].GetDirection() ? 0 : 1));
+					chr = block[i].GetChrId();
+					position = block[i].GetStart();
+				}
+
+				previousId = block[start].GetBlockId();
+			}
+		}
+	};
+
+	//Writes the sequences of the blocks as FASTA records, grouped by block id
+	class FastaWriter : public BlockWriter
+	{
+	public:
+		FastaWriter(std::ostream & out, const std::vector<SequenceInfo> & sequence, const GenomeSequences & genome) : BlockWriter(out, sequence), genome_(genome)
+		{
+
+		}
+
+	protected:
+		void Format(const BlockInstance * block, size_t count, int64_t, std::string & buffer) const
+		{
+			std::string sequence;
+			for (size_t i = 0; i < count; i++)
+			{
+				buffer += ">Seq=\"";
+				buffer += sequence_[block[i].GetChrId()].description;
+				buffer += block[i].GetDirection() ? "\",Strand='+',Block_id=" : "\",Strand='-',Block_id=";
+				AppendInt(buffer, block[i].GetBlockId());
+				buffer += ",Start=";
+				AppendInt(buffer, block[i].GetConventionalStart());
+				buffer += ",End=";
+				AppendInt(buffer, block[i].GetConventionalEnd());
+				buffer.push_back('\n');
+				sequence.clear();
+				genome_.Append(block[i], sequence);
+				for (size_t pos = 0; pos < sequence.size(); pos += LINE_LENGTH)
+				{
+					buffer.append(sequence, pos, LINE_LENGTH);
+					buffer.push_back('\n');
+				}
+			}
+		}
+
+	private:
+		static const size_t LINE_LENGTH = 80;
+		const GenomeSequences & genome_;
+	};
+
+	class BinaryReader
+	{
+	public:
+		BinaryReader(std::istream & in) : in_(in), lastId_(0)
+		{
+			uint64_t magic = 0;
+			in_.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+			if (magic != BinaryWriter::MAGIC)
+			{
+				throw std::runtime_error("Not a binary blocks file");
+			}
+
+			sequence_.resize(ReadVarint());
+			for (SequenceInfo & info : sequence_)
+			{
+				info.description.resize(ReadVarint());
+				in_.read(&info.description[0], info.description.size());
+				info.size = ReadVarint();
+			}
+		}
+
+		const std::vector<SequenceInfo> & GetSequences() const
+		{
+			return sequence_;
+		}
+
+		//Reads the instances of the next block, returns false after the last one
+		bool ReadBlock(std::vector<BlockInstance> & block)
+		{
+			block.clear();
+			uint64_t idDiff = ReadVarint();
+			if (idDiff == 0)
+			{
+				return false;
+			}
+
+			size_t chr = 0;
+			size_t start = 0;
+			lastId_ += idDiff;
+			for (uint64_t count = ReadVarint(); count > 0; count--)
+			{
+				size_t chrDiff = ReadVarint();
+				size_t startDiff = ReadVarint();
+				uint64_t length = ReadVarint();
+				start = chrDiff == 0 && !block.empty() ? start + startDiff : startDiff;
+				chr += chrDiff;
+				if (chr >= sequence_.size())
+				{
+					throw std::runtime_error("Corrupted binary blocks file");
+				}
+
+				block.push_back(BlockInstance((length & 1) ? -lastId_ : lastId_, chr, start, start + (length >> 1)));
+			}
+
+			return true;
+		}
+
+	private:
+		std::istream & in_;
+		int64_t lastId_;
+		std::vector<SequenceInfo> sequence_;
+
+		uint64_t ReadVarint()
+		{
+			uint64_t ret = 0;
+			for (size_t shift = 0; ; shift += 7)
+			{
+				int ch = in_.get();
+				if (ch == std::char_traits<char>::eof() || shift > 63)
+				{
+					throw std::runtime_error("Truncated binary blocks file");
+				}
+
+				ret |= uint64_t(ch & 0x7f) << shift;
+				if ((ch & 0x80) == 0)
+				{
+					return ret;
+				}
+			}
+		}
+	};
+
+	inline std::string GetBlocksFileName(const std::string & format)
+	{
+		if (format == "gff")
+		{
+			return "blocks_coords.gff";
+		}
+
+		if (format == "paf")
+		{
+			return "blocks_coords.paf";
+		}
+
+		if (format == "binary")
+		{
+			return "blocks_coords.bin";
+		}
+
+		return "blocks_coords.txt";
+	}
+
+	//Formats: gff, paf, binary and legacy
+	inline BlockWriter * CreateBlockWriter(const std::string & format, std::ostream & out, const std::vector<SequenceInfo> & sequence)
+	{
+		if (format == "gff")
+		{
+			return new GffWriter(out, sequence);
+		}
+
+		if (format == "paf")
+		{
+			return new PafWriter(out, sequence);
+		}
+
+		if (format == "binary")
+		{
+			return new BinaryWriter(out, sequence);
+		}
+
+		if (format == "legacy")
+		{
+			return new LegacyWriter(out, sequence);
+		}
+
+		throw std::runtime_error(("Unknown output format " + format).c_str());
+	}
+}
+
+#endif
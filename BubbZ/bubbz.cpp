@@ -10,6 +10,124 @@ size_t Atoi(const char * str)
 	return ret;
 }
 
+bool ChromosomesFit(const std::vector<std::string> & genomesFileName, uint64_t limit)
+{
+	for (const auto & fileName : genomesFileName)
+	{
+		std::ifstream in(fileName.c_str(), std::ios::binary | std::ios::ate);
+		if (in && uint64_t(in.tellg()) < limit)
+		{
+			continue;
+		}
+
+		uint64_t length = 0;
+		in.seekg(0);
+		for (std::string line; std::getline(in, line); )
+		{
+			if (!line.empty() && line[0] == '>')
+			{
+				length = 0;
+			}
+			else
+			{
+				length += line.size() - (!line.empty() && line.back() == '\r' ? 1 : 0);
+				if (length >= limit)
+				{
+					return false;
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+bool IsWideSnapshot(const std::string & snapshotFileName)
+{
+	uint64_t header[2];
+	std::ifstream in(snapshotFileName.c_str(), std::ios::binary);
+	if (!in.read(reinterpret_cast<char*>(header), sizeof(header)))
+	{
+		throw std::runtime_error(("Cannot read the snapshot " + snapshotFileName).c_str());
+	}
+
+	return header[1] == sizeof(uint64_t);
+}
+
+size_t GetGenomeIndex(const std::vector<std::string> & genomesFileName, const std::string & fileName)
+{
+	auto it = std::find(genomesFileName.begin(), genomesFileName.end(), fileName);
+	if (it == genomesFileName.end())
+	{
+		throw std::runtime_error(("The genome " + fileName + " is not among the input files").c_str());
+	}
+
+	return it - genomesFileName.begin();
+}
+
+template<class Width>
+void Run(const std::string & inFileName,
+	const std::vector<std::string> & genomesFileName,
+	const std::string & snapshotFileName,
+	bool loadSnapshot,
+	const std::string & outDirName,
+	int64_t k,
+	int64_t minBlockSize,
+	int64_t maxBranchSize,
+	int64_t threads,
+	int64_t abundanceThreshold,
+	bool mapSequences,
+	bool dropSingletons,
+	const Sibelia::GenomePairs & pairs,
+	const std::string & previousBlocksFileName,
+	bool legacyOut,
+	bool sequencesOut,
+	bool align,
+	const std::string & format,
+	std::ostream * out)
+{
+	double start = omp_get_wtime();
+	std::unique_ptr<Sibelia::JunctionStorage<Width> > storage;
+	if (loadSnapshot)
+	{
+		std::cout << "Loading the snapshot..." << std::endl;
+		storage.reset(new Sibelia::JunctionStorage<Width>(snapshotFileName, k, abundanceThreshold, dropSingletons));
+	}
+	else
+	{
+		std::cout << "Loading the graph..." << std::endl;
+		storage.reset(new Sibelia::JunctionStorage<Width>(inFileName,
+			genomesFileName,
+			k,
+			threads,
+			abundanceThreshold,
+			0,
+			mapSequences,
+			dropSingletons));
+		if (!snapshotFileName.empty())
+		{
+			storage->SaveSnapshot(snapshotFileName);
+		}
+	}
+
+	std::cout << "Analyzing the graph..." << std::endl;
+	Sibelia::BlocksFinder<Width> finder(*storage, k);
+	finder.AddPhaseTime("load", omp_get_wtime() - start);
+	finder.SetGenomePairs(pairs);
+	finder.SetSequenceFiles(genomesFileName);
+	if (!previousBlocksFileName.empty())
+	{
+		finder.LoadBlocks(previousBlocksFileName);
+	}
+
+	finder.FindBlocks(minBlockSize,
+		maxBranchSize,
+		threads,
+		outDirName);
+	std::cout << "Generating the output..." << std::endl;
+	finder.GenerateOutput(outDirName, sequencesOut, legacyOut, format, out, align);
+}
+
 class OddConstraint : public TCLAP::Constraint < unsigned int >
 {
 public:
@@ -37,6 +155,10 @@ public:
 int main(int argc, char * argv[])
 {
 	OddConstraint constraint;
+	std::vector<std::string> formats = { "gff", "paf", "binary" };
+	TCLAP::ValuesConstraint<std::string> formatConstraint(formats);
+	std::streambuf * coutBuffer = std::cout.rdbuf();
+	std::ostream dataOut(coutBuffer);
 
 	try
 	{
@@ -98,12 +220,99 @@ int main(int argc, char * argv[])
 			"directory name",
 			cmd);
 
+		TCLAP::ValueArg<std::string> snapshotFileName("",
+			"snapshot",
+			"Snapshot of the loaded graph, reused while it is newer than the graph",
+			false,
+			"",
+			"file name",
+			cmd);
+
 		TCLAP::SwitchArg legacyOut("",
 			"legacy",
 			"Output indices in legacy format",
 			cmd,
 			false);
 
+		TCLAP::ValueArg<std::string> format("",
+			"format",
+			"Format of the blocks output",
+			false,
+			"gff",
+			&formatConstraint,
+			cmd);
+
+		TCLAP::SwitchArg toStdout("",
+			"stdout",
+			"Write the blocks to the standard output, the log goes to the standard error",
+			cmd,
+			false);
+
+		TCLAP::SwitchArg sequencesOut("",
+			"sequences",
+			"Output the sequences of the blocks",
+			cmd,
+			false);
+
+		TCLAP::SwitchArg align("",
+			"align",
+			"Align the copies of every block against each other",
+			cmd,
+			false);
+
+		TCLAP::SwitchArg mapSequences("",
+			"mmap",
+			"Memory-map the FASTA files instead of loading them",
+			cmd,
+			false);
+
+		TCLAP::SwitchArg dropSingletons("",
+			"nosingletons",
+			"Drop junctions that occur only once",
+			cmd,
+			false);
+
+		TCLAP::SwitchArg wideCoordinates("",
+			"wide",
+			"Use 64-bit coordinates even if all chromosomes fit into 32 bits",
+			cmd,
+			false);
+
+		TCLAP::SwitchArg interOnly("",
+			"inter",
+			"Only map different genomes against each other",
+			cmd,
+			false);
+
+		TCLAP::MultiArg<std::string> referenceFileName("",
+			"reference",
+			"Input file of a reference genome, only reference-vs-query pairs are mapped",
+			false,
+			"file name",
+			cmd);
+
+		TCLAP::MultiArg<std::string> subsetFileName("",
+			"subset",
+			"Input file of a genome to map, only pairs within the subset are mapped",
+			false,
+			"file name",
+			cmd);
+
+		TCLAP::ValueArg<std::string> previousBlocksFileName("",
+			"previous",
+			"GFF output of a previous run, its blocks are kept and only the pairs with new genomes are mapped",
+			false,
+			"",
+			"file name",
+			cmd);
+
+		TCLAP::MultiArg<std::string> newFileName("",
+			"new",
+			"Input file of a genome added since the previous run",
+			false,
+			"file name",
+			cmd);
+
 		TCLAP::UnlabeledMultiArg<std::string> genomesFileName("filenames",
 			"FASTA file(s) with nucleotide sequences.",
 			true,
@@ -112,33 +321,103 @@ int main(int argc, char * argv[])
 
 		cmd.parse(argc, argv);
 
-		std::cout << "Loading the graph..." << std::endl;
-		Sibelia::JunctionStorage storage(inFileName.getValue(),
-			genomesFileName.getValue(),
-			kvalue.getValue(),
-			threads.getValue(),
-			abundanceThreshold.getValue(),
-			0);
-
-		std::cout << "Analyzing the graph..." << std::endl;
-		Sibelia::BlocksFinder finder(storage, kvalue.getValue());
-		finder.FindBlocks(minBlockSize.getValue(),
-			maxBranchSize.getValue(),
-			threads.getValue(),
-			outDirName.getValue() + "/paths.txt");
-		std::cout << "Generating the output..." << std::endl;
-		finder.GenerateOutput(outDirName.getValue(), false, legacyOut.getValue());
+		Sibelia::GenomePairs pairs;
+		pairs.SetInterOnly(interOnly.getValue());
+		for (const std::string & fileName : referenceFileName.getValue())
+		{
+			pairs.AddReference(GetGenomeIndex(genomesFileName.getValue(), fileName));
+		}
+
+		for (const std::string & fileName : subsetFileName.getValue())
+		{
+			pairs.AddSubset(GetGenomeIndex(genomesFileName.getValue(), fileName));
+		}
+
+		if (!previousBlocksFileName.getValue().empty() && newFileName.getValue().empty())
+		{
+			throw std::runtime_error("The new genomes must be given with --new to extend the previous blocks");
+		}
+
+		for (const std::string & fileName : newFileName.getValue())
+		{
+			pairs.AddNew(GetGenomeIndex(genomesFileName.getValue(), fileName));
+		}
+
+		if (toStdout.getValue())
+		{
+			std::cout.rdbuf(std::cerr.rdbuf());
+		}
+
+		bool wide = wideCoordinates.getValue();
+		uint64_t narrowLimit = INT32_MAX - uint64_t(kvalue.getValue());
+		bool loadSnapshot = !snapshotFileName.getValue().empty() && Sibelia::MappedFile::IsNewer(snapshotFileName.getValue(), inFileName.getValue());
+		if (loadSnapshot)
+		{
+			wide = IsWideSnapshot(snapshotFileName.getValue());
+		}
+		else if (!wide)
+		{
+			wide = !ChromosomesFit(genomesFileName.getValue(), narrowLimit);
+		}
+
+		if (!wide)
+		{
+			Run<Sibelia::NarrowWidth>(inFileName.getValue(),
+				genomesFileName.getValue(),
+				snapshotFileName.getValue(),
+				loadSnapshot,
+				outDirName.getValue(),
+				kvalue.getValue(),
+				minBlockSize.getValue(),
+				maxBranchSize.getValue(),
+				threads.getValue(),
+				abundanceThreshold.getValue(),
+				mapSequences.getValue(),
+				dropSingletons.getValue(),
+				pairs,
+				previousBlocksFileName.getValue(),
+				legacyOut.getValue(),
+				sequencesOut.getValue(),
+				align.getValue(),
+				format.getValue(),
+				toStdout.getValue() ? &dataOut : 0);
+		}
+		else
+		{
+			Run<Sibelia::WideWidth>(inFileName.getValue(),
+				genomesFileName.getValue(),
+				snapshotFileName.getValue(),
+				loadSnapshot,
+				outDirName.getValue(),
+				kvalue.getValue(),
+				minBlockSize.getValue(),
+				maxBranchSize.getValue(),
+				threads.getValue(),
+				abundanceThreshold.getValue(),
+				mapSequences.getValue(),
+				dropSingletons.getValue(),
+				pairs,
+				previousBlocksFileName.getValue(),
+				legacyOut.getValue(),
+				sequencesOut.getValue(),
+				align.getValue(),
+				format.getValue(),
+				toStdout.getValue() ? &dataOut : 0);
+		}
 	}
 	catch (TCLAP::ArgException & e)
 	{
+		std::cout.rdbuf(coutBuffer);
 		std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl;
 		return 1;
 	}
 	catch (std::runtime_error & e)
 	{
+		std::cout.rdbuf(coutBuffer);
 		std::cerr << "error: " << e.what() << std::endl;
 		return 1;
 	}
 
+	std::cout.rdbuf(coutBuffer);
 	return 0;
 }
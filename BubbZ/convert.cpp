@@ -0,0 +1,82 @@
+#include <tclap/CmdLine.h>
+
+#include "blocksfinder.h"
+
+int main(int argc, char * argv[])
+{
+	std::vector<std::string> formats = { "gff", "paf", "legacy" };
+	TCLAP::ValuesConstraint<std::string> formatConstraint(formats);
+
+	try
+	{
+		TCLAP::CmdLine cmd("BubbZ-convert, converts the binary blocks output to other formats", ' ', Sibelia::VERSION);
+
+		TCLAP::ValueArg<std::string> format("",
+			"format",
+			"Format of the output",
+			false,
+			"gff",
+			&formatConstraint,
+			cmd);
+
+		TCLAP::ValueArg<std::string> outFileName("o",
+			"outfile",
+			"Output file, the standard output by default",
+			false,
+			"",
+			"file name",
+			cmd);
+
+		TCLAP::UnlabeledValueArg<std::string> inFileName("filename",
+			"Binary blocks file",
+			true,
+			"",
+			"blocks_coords.bin",
+			cmd);
+
+		cmd.parse(argc, argv);
+
+		std::ifstream in(inFileName.getValue().c_str(), std::ios::binary);
+		if (!in)
+		{
+			throw std::runtime_error(("Cannot open file " + inFileName.getValue()).c_str());
+		}
+
+		std::ofstream file;
+		if (!outFileName.getValue().empty())
+		{
+			file.open(outFileName.getValue().c_str());
+			if (!file)
+			{
+				throw std::runtime_error(("Cannot open file " + outFileName.getValue()).c_str());
+			}
+		}
+
+		Sibelia::BinaryReader reader(in);
+		std::ostream & out = outFileName.getValue().empty() ? std::cout : file;
+		std::unique_ptr<Sibelia::BlockWriter> writer(Sibelia::CreateBlockWriter(format.getValue(), out, reader.GetSequences()));
+		for (std::vector<Sibelia::BlockInstance> block; reader.ReadBlock(block); )
+		{
+			writer->Write(block.data(), block.size());
+		}
+
+		writer->Finish();
+		out.flush();
+		if (!out)
+		{
+			throw std::runtime_error("Cannot write the output");
+		}
+	}
+	catch (TCLAP::ArgException & e)
+	{
+		std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl;
+		return 1;
+	}
+	catch (std::runtime_error & e)
+	{
+		std::cerr << "error: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,219 @@
+#ifndef _FASTA_INDEX_H_
+#define _FASTA_INDEX_H_
+
+#include <string>
+#include <vector>
+#include <cctype>
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "mappedfile.h"
+
+namespace Sibelia
+{
+	//A FASTA file accessed through mmap and a .fai-style line index. The index
+	//is stored next to the file as <file>.bubbz.fai and reused when it is newer
+	//than the file. Unlike samtools, the full header line is kept as the name.
+	class IndexedFasta
+	{
+	public:
+		struct Record
+		{
+			std::string description;
+			uint64_t length;
+			uint64_t offset;
+			uint64_t lineBases;
+			uint64_t lineWidth;
+		};
+
+		IndexedFasta(const std::string & fileName) : fileName_(fileName), valid_(true)
+		{
+			std::string indexFileName = fileName + ".bubbz.fai";
+			if (!MappedFile::IsNewer(indexFileName, fileName) || !ReadIndex(indexFileName))
+			{
+				BuildIndex();
+				if (valid_)
+				{
+					WriteIndex(indexFileName);
+				}
+			}
+
+			if (valid_)
+			{
+				file_.Open(fileName, MADV_RANDOM);
+			}
+		}
+
+		bool Valid() const
+		{
+			return valid_;
+		}
+
+		size_t GetRecordNumber() const
+		{
+			return record_.size();
+		}
+
+		const Record & GetRecord(size_t record) const
+		{
+			return record_[record];
+		}
+
+		char GetChar(size_t record, uint64_t pos) const
+		{
+			const Record & r = record_[record];
+			if (pos >= r.length)
+			{
+				return 0;
+			}
+
+			return NormalChar(file_.GetData()[r.offset + (pos / r.lineBases) * r.lineWidth + pos % r.lineBases]);
+		}
+
+		//Appends the characters [start, end) of the record, line by line
+		void AppendSequence(size_t record, uint64_t start, uint64_t end, std::string & buffer) const
+		{
+			const Record & r = record_[record];
+			for (end = std::min(end, r.length); start < end; )
+			{
+				uint64_t column = start % r.lineBases;
+				uint64_t count = std::min(end - start, r.lineBases - column);
+				const char * data = file_.GetData() + r.offset + (start / r.lineBases) * r.lineWidth + column;
+				for (uint64_t i = 0; i < count; i++)
+				{
+					buffer.push_back(NormalChar(data[i]));
+				}
+
+				start += count;
+			}
+		}
+
+		static char NormalChar(char ch)
+		{
+			ch = toupper(ch);
+			return ch == 'A' || ch == 'C' || ch == 'G' || ch == 'T' ? ch : 'N';
+		}
+
+	private:
+		IndexedFasta(const IndexedFasta &);
+		IndexedFasta & operator = (const IndexedFasta &);
+
+		std::string fileName_;
+		bool valid_;
+		MappedFile file_;
+		std::vector<Record> record_;
+
+		bool ReadIndex(const std::string & indexFileName)
+		{
+			std::ifstream in(indexFileName.c_str());
+			for (std::string line; std::getline(in, line); )
+			{
+				Record r;
+				std::vector<uint64_t> field;
+				size_t end = line.size();
+				for (size_t i = 0; i < 4; i++)
+				{
+					size_t tab = end > 0 ? line.rfind('\t', end - 1) : std::string::npos;
+					if (tab == std::string::npos)
+					{
+						return false;
+					}
+
+					std::stringstream ss(line.substr(tab + 1, end - tab - 1));
+					field.push_back(0);
+					ss >> field.back();
+					end = tab;
+				}
+
+				r.description = line.substr(0, end);
+				r.lineWidth = field[0];
+				r.lineBases = field[1];
+				r.offset = field[2];
+				r.length = field[3];
+				if (r.lineBases == 0 && r.length > 0)
+				{
+					return false;
+				}
+
+				record_.push_back(r);
+			}
+
+			return true;
+		}
+
+		void WriteIndex(const std::string & indexFileName) const
+		{
+			std::ofstream out(indexFileName.c_str());
+			for (const Record & r : record_)
+			{
+				out << r.description << '\t' << r.length << '\t' << r.offset << '\t' << r.lineBases << '\t' << r.lineWidth << '\n';
+			}
+
+			if (!out)
+			{
+				std::remove(indexFileName.c_str());
+			}
+		}
+
+		//A record is indexable only if all of its lines except the last one
+		//have the same length and width
+		void BuildIndex()
+		{
+			std::ifstream in(fileName_.c_str(), std::ios::binary);
+			if (!in)
+			{
+				throw std::runtime_error(("Cannot open file " + fileName_).c_str());
+			}
+
+			record_.clear();
+			bool shortLine = false;
+			uint64_t offset = 0;
+			for (std::string line; std::getline(in, line); )
+			{
+				uint64_t width = line.size() + (in.eof() ? 0 : 1);
+				if (!line.empty() && line.back() == '\r')
+				{
+					line.pop_back();
+				}
+
+				if (!line.empty() && line[0] == '>')
+				{
+					record_.push_back(Record());
+					record_.back().description = line.substr(1);
+					record_.back().length = record_.back().lineBases = record_.back().lineWidth = 0;
+					record_.back().offset = offset + width;
+					shortLine = false;
+				}
+				else if (!record_.empty() && !line.empty())
+				{
+					Record & r = record_.back();
+					if (r.lineBases == 0)
+					{
+						r.lineBases = line.size();
+						r.lineWidth = width;
+					}
+					else if (shortLine || line.size() > r.lineBases || (line.size() == r.lineBases && width != r.lineWidth && !in.eof()))
+					{
+						valid_ = false;
+						return;
+					}
+
+					shortLine = line.size() < r.lineBases;
+					r.length += line.size();
+				}
+				else if (!record_.empty())
+				{
+					shortLine = true;
+				}
+
+				offset += width;
+			}
+		}
+	};
+}
+
+#endif
@@ -2,44 +2,138 @@
 #define _JUNCTION_STORAGE_H_
 
 #include <set>
+#include <map>
 #include <atomic>
+#include <fstream>
 #include <string>
 #include <vector>
 #include <memory>
+#include <limits>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <stdexcept>
 #include <algorithm>
 
 #include <streamfastaparser.h>
 #include <junctionapi.h>
 
+#include "fastaindex.h"
+#include "mappedfile.h"
+
 namespace Sibelia
 {
 	using std::min;
 	using std::max;
+	using std::abs;
+
+	//Widths of coordinates, junction indices and vertex ids. The narrow one is
+	//used when every chromosome fits into it, the wide one otherwise
+	struct NarrowWidth
+	{
+		typedef int32_t Coordinate;
+		typedef uint32_t Index;
+		typedef int32_t VertexId;
+	};
 
-	
+	struct WideWidth
+	{
+		typedef int64_t Coordinate;
+		typedef uint64_t Index;
+		typedef int64_t VertexId;
+	};
+
+	template<class Width>
 	class JunctionStorage
 	{
+	public:
+		typedef typename Width::Coordinate Coordinate;
+		typedef typename Width::Index Index;
+		typedef typename Width::VertexId VertexId;
+
 	private:
 
-		struct Position
+		//Junctions are stored column-wise: positions, the vertex column read by
+		//instance lookups and the link column read when following the
+		//occurrences of a vertex. The top bit of nextChr is the strand flip. With
+		//32-bit indices a junction takes 4 + 8 + 8 = 20 bytes, the vertex record
+		//has one byte of padding.
+		struct Vertex
 		{
-			uint32_t pos;
-			uint32_t nextIdx;
-			int32_t nextChr;
-			int64_t vertexId;
+			VertexId id;
 			uint16_t pointerIdx;
-			char ch;
-			char revCh;
-			bool invert;
+			uint8_t chars;
+		};
+
+		struct Link
+		{
+			Index nextIdx;
+			uint32_t nextChr;
+		};
+
+		struct PositionColumns
+		{
+			Column<Index> pos;
+			Column<Vertex> vertex;
+			Column<Link> link;
+
+			size_t size() const
+			{
+				return pos.size();
+			}
+
+			void Allocate(size_t size)
+			{
+				pos.Allocate(size);
+				vertex.Allocate(size);
+				link.Allocate(size);
+			}
 
-			Position(const TwoPaCo::JunctionPosition & junction) : nextIdx(UINT_MAX), vertexId(junction.GetId())
+			void Shrink(size_t size)
 			{
-				pos = junction.GetPos();
+				pos.Shrink(size);
+				vertex.Shrink(size);
+				link.Shrink(size);
+			}
+
+			void Set(size_t idx, const TwoPaCo::JunctionPosition & junction)
+			{
+				Vertex v = { static_cast<VertexId>(junction.GetId()), 0, 0 };
+				Link l = { NO_NEXT, 0 };
+				pos[idx] = junction.GetPos();
+				vertex[idx] = v;
+				link[idx] = l;
 			}
 		};
 
+		static const uint32_t INVERT_BIT = uint32_t(1) << 31;
+		static const Index NO_NEXT = Index(-1);
+
+		static uint8_t EncodeChar(char ch)
+		{
+			switch (ch)
+			{
+			case 'A':
+				return 0;
+			case 'C':
+				return 1;
+			case 'G':
+				return 2;
+			case 'T':
+				return 3;
+			case 'N':
+				return 4;
+			}
+
+			return 5;
+		}
+
+		static char DecodeChar(uint8_t code)
+		{
+			static const char table[] = { 'A', 'C', 'G', 'T', 'N', 0, 0, 0 };
+			return table[code & 7];
+		}
+
 		struct PrevPosition
 		{
 			PrevPosition() : prevId(0)
@@ -49,27 +143,25 @@ namespace Sibelia
 
 			int64_t prevId;
 			uint32_t prevChr;
-			uint32_t prevIdx;
+			Index prevIdx;
 		};
 
-		typedef std::vector<Position> PositionVector;
-
 	public:
 
 		class Iterator
 		{
 		public:
-			Iterator(): chrId_(SIZE_MAX)
+			Iterator(): storage_(0), chrId_(SIZE_MAX)
 			{
 
 			}
 
-			Iterator(size_t chrId) : chrId_(chrId), idx_(0), isPositive_(true)
+			Iterator(const JunctionStorage & storage, size_t chrId) : storage_(&storage), chrId_(chrId), idx_(storage.chrStart_[chrId]), isPositive_(true)
 			{
 
 			}
 
-			Iterator(size_t chrId, int32_t idx, bool isPositive = true) : chrId_(chrId), idx_(idx), isPositive_(isPositive)
+			Iterator(const JunctionStorage & storage, size_t chrId, size_t idx, bool isPositive = true) : storage_(&storage), chrId_(chrId), idx_(storage.chrStart_[chrId] + idx), isPositive_(isPositive)
 			{
 
 			}
@@ -93,16 +185,16 @@ namespace Sibelia
 
 			void Next()
 			{
-				auto & pos = JunctionStorage::this_->position_[chrId_][idx_];
-				if (pos.nextIdx != UINT_MAX)
+				const auto & link = storage_->position_.link[idx_];
+				if (link.nextIdx != NO_NEXT)
 				{
-					if (pos.invert)
+					if (link.nextChr & INVERT_BIT)
 					{
 						isPositive_ = !isPositive_;
 					}
 
-					idx_ = pos.nextIdx;
-					chrId_ = pos.nextChr;
+					chrId_ = link.nextChr & ~INVERT_BIT;
+					idx_ = storage_->chrStart_[chrId_] + link.nextIdx;
 				}
 				else
 				{
@@ -113,7 +205,7 @@ namespace Sibelia
 
 			int32_t GetPointerIndex() const
 			{
-				return JunctionStorage::this_->position_[chrId_][idx_].pointerIdx;
+				return storage_->position_.vertex[idx_].pointerIdx;
 			}
 
 			int32_t GetChrId() const
@@ -121,44 +213,44 @@ namespace Sibelia
 				return static_cast<int32_t>(chrId_);
 			}
 
-			int32_t PreviousPosition() const
+			Coordinate PreviousPosition() const
 			{
 				if (IsPositiveStrand())
 				{
-					return JunctionStorage::this_->position_[GetChrId()][idx_ - 1].pos;
+					return storage_->position_.pos[idx_ - 1];
 				}
 
-				return -(JunctionStorage::this_->position_[GetChrId()][idx_ + 1].pos + JunctionStorage::this_->k_);
+				return -(storage_->position_.pos[idx_ + 1] + storage_->k_);
 			}
 
-			int32_t GetVertexId() const
+			VertexId GetVertexId() const
 			{
 				if (IsPositiveStrand())
 				{
-					return JunctionStorage::this_->position_[GetChrId()][idx_].vertexId;
+					return storage_->position_.vertex[idx_].id;
 				}
 
-				return -JunctionStorage::this_->position_[GetChrId()][idx_].vertexId;
+				return -storage_->position_.vertex[idx_].id;
 			}
 
-			int32_t GetPosition() const
+			Coordinate GetPosition() const
 			{
 				if (IsPositiveStrand())
 				{
-					return JunctionStorage::this_->position_[GetChrId()][idx_].pos;
+					return storage_->position_.pos[idx_];
 				}
 
-				return -(JunctionStorage::this_->position_[GetChrId()][idx_].pos + JunctionStorage::this_->k_);
+				return -(storage_->position_.pos[idx_] + storage_->k_);
 			}
 
 			char GetChar() const
 			{
 				if (IsPositiveStrand())
 				{
-					return JunctionStorage::this_->position_[chrId_][idx_].ch;
+					return DecodeChar(storage_->position_.vertex[idx_].chars);
 				}
 
-				return JunctionStorage::this_->position_[chrId_][idx_].revCh;
+				return DecodeChar(storage_->position_.vertex[idx_].chars >> 3);
 			}
 
 			bool IsPositiveStrand() const
@@ -168,17 +260,17 @@ namespace Sibelia
 
 			size_t GetIndex() const
 			{
-				return idx_;
+				return idx_ - storage_->chrStart_[chrId_];
 			}
 
 			bool Valid() const
 			{
-				return chrId_ < JunctionStorage::this_->position_.size() && idx_ < JunctionStorage::this_->position_[chrId_].size();
+				return storage_ != 0 && chrId_ < storage_->chrStart_.size() - 1 && idx_ - storage_->chrStart_[chrId_] < storage_->chrStart_[chrId_ + 1] - storage_->chrStart_[chrId_];
 			}
 
 			bool operator == (const Iterator & arg) const
 			{
-				return this->chrId_ == arg.chrId_ && this->idx_ == arg.idx_ && isPositive_ == arg.isPositive_;
+				return this->storage_ == arg.storage_ && this->chrId_ == arg.chrId_ && this->idx_ == arg.idx_ && isPositive_ == arg.isPositive_;
 			}
 
 			bool operator != (const Iterator & arg) const
@@ -188,14 +280,16 @@ namespace Sibelia
 
 
 		private:
+			const JunctionStorage * storage_;
 			size_t chrId_;
+			//The index of the junction in the columns of the whole storage
 			size_t idx_;
 			bool isPositive_;
 		};
 
 		int64_t GetVertexId(size_t chr, size_t idx) const
 		{
-			return position_[chr][idx].vertexId;
+			return position_.vertex[chrStart_[chr] + idx].id;
 		}
 
 		int64_t GetMaxVertexId() const
@@ -205,18 +299,24 @@ namespace Sibelia
 
 		int64_t GetPosition(size_t chr, size_t idx) const
 		{
-			return position_[chr][idx].pos;
+			return position_.pos[chrStart_[chr] + idx];
 		}
 
 
 		int32_t GetPointerIndex(size_t chr, size_t idx) const
 		{
-			return position_[chr][idx].pointerIdx;
+			return position_.vertex[chrStart_[chr] + idx].pointerIdx;
+		}
+
+		//The vertex id and the pointer index of a junction share a record
+		void PrefetchVertex(size_t chr, size_t idx) const
+		{
+			Prefetch(&position_.vertex[chrStart_[chr] + idx]);
 		}
 
 		size_t GetChrNumber() const
 		{
-			return position_.size();
+			return chrStart_.size() - 1;
 		}
 
 		const std::string& GetChrDescription(uint64_t idx) const
@@ -224,86 +324,159 @@ namespace Sibelia
 			return sequenceDescription_[idx];
 		}
 
+		bool FindChr(const std::string & description, size_t & chr) const
+		{
+			auto it = sequenceId_.find(description);
+			if (it == sequenceId_.end())
+			{
+				return false;
+			}
+
+			chr = it->second;
+			return true;
+		}
+
 		size_t GeChrSequenceSize(size_t chr) const
 		{
 			return chrSeqSize_[chr];
 		}
 
+		//The junction columns, mapped from the snapshot or owned
+		size_t GetMemoryUsage() const
+		{
+			return position_.size() * (sizeof(Index) + sizeof(Vertex) + sizeof(Link)) + chrStart_.size() * sizeof(size_t);
+		}
+
 		size_t GeChrSize(size_t chr) const
 		{
-			return position_[chr].size();
+			return chrStart_[chr + 1] - chrStart_[chr];
 		}
 
-		void Init(const std::string & inFileName, const std::vector<std::string> & genomesFileName, int64_t threads, int64_t abundanceThreshold, int64_t loopThreshold)
+		//Index of the FASTA file the chromosome comes from
+		size_t GetChrGenome(size_t chr) const
 		{
-			this_ = this;
-			size_t record = 0;
-			maxId_ = 0;
+			return chr < chrGenome_.size() ? chrGenome_[chr] : 0;
+		}
+
+		//True if the occurrences of every vertex are linked in the order of
+		//chromosomes, so Next() never moves to a preceding chromosome
+		bool IsChrSorted() const
+		{
+			return chrSorted_;
+		}
 
-			std::vector<std::string> sequence_(position_.size());
-			for (const auto & fastaFileName : genomesFileName)
+		void Init(const std::string & inFileName, const std::vector<std::string> & genomesFileName, int64_t threads, int64_t abundanceThreshold, int64_t loopThreshold, bool mapSequences = false, bool dropSingletons = false)
+		{
+			maxId_ = 0;
+			dropSingletons_ = dropSingletons;
+			threads = max(threads, int64_t(1));
+
+			std::string error;
+			bool chrSorted = true;
+			std::vector<Pointer> streamOrder;
+			std::vector<std::vector<FastaRecord> > record(genomesFileName.size());
+			std::vector<std::unique_ptr<IndexedFasta> > indexed(genomesFileName.size());
+			ReadJunctions(inFileName, threads, chrSorted, streamOrder);
+			int64_t files = mapSequences ? genomesFileName.size() : 0;
+			#pragma omp parallel for schedule(dynamic, 1) num_threads(threads)
+			for (int64_t file = 0; file < files; file++)
 			{
-				for (TwoPaCo::StreamFastaParser parser(fastaFileName); parser.ReadRecord(); record++)
+				try
 				{
-					sequenceDescription_.push_back(parser.GetCurrentHeader());
-					sequenceId_[parser.GetCurrentHeader()] = sequenceDescription_.size() - 1;
-					sequence_.push_back(std::string());
-					for (char ch; parser.GetChar(ch); )
+					indexed[file].reset(new IndexedFasta(genomesFileName[file]));
+					if (!indexed[file]->Valid())
 					{
-						sequence_[record].push_back(ch);
+						indexed[file].reset();
+					}
+				}
+				catch (std::exception & e)
+				{
+					#pragma omp critical
+					{
+						error = e.what();
 					}
-
-					chrSeqSize_.push_back(sequence_[record].size());
 				}
 			}
 
-			std::vector<PrevPosition> prevPos;
-			position_.resize(sequence_.size());
-			TwoPaCo::JunctionPositionReader reader(inFileName);
-			for (TwoPaCo::JunctionPosition junction; reader.NextJunctionPosition(junction);)
+			if (!error.empty())
 			{
-				size_t absId = abs(junction.GetId());
-				maxId_ = max(absId, maxId_);
-				if (absId >= prevPos.size())
+				throw std::runtime_error(error.c_str());
+			}
+
+			//The files without an index are parsed one by one with all threads
+			for (size_t file = 0; file < genomesFileName.size(); file++)
+			{
+				if (!indexed[file])
 				{
-					prevPos.resize(absId + 1);
+					ReadFasta(genomesFileName[file], record[file], threads);
 				}
-			
-				{
-					auto chr = junction.GetChr();
-					auto pos = junction.GetPos();
-					position_[chr].push_back(Position(junction));
-					position_[chr].back().ch = sequence_[chr][pos + JunctionStorage::this_->k_];
-					position_[chr].back().revCh = pos > 0 ? TwoPaCo::DnaChar::ReverseChar(sequence_[chr][pos - 1]) : 'N';
-					if (prevPos[absId].prevId != 0)
-					{
-						auto & prev = prevPos[absId];
-						position_[prev.prevChr][prev.prevIdx].nextChr = junction.GetChr();
-						position_[prev.prevChr][prev.prevIdx].invert = prev.prevId != junction.GetId();
-						position_[prev.prevChr][prev.prevIdx].nextIdx = position_[junction.GetChr()].size() - 1;
-						position_[chr].back().pointerIdx = position_[prev.prevChr][prev.prevIdx].pointerIdx + 1;
-					}
-					else
+			}
+
+			FilterJunctions(threads, abundanceThreshold, dropSingletons, chrSorted, streamOrder);
+			chrSorted_ = chrSorted;
+
+			std::vector<std::string> sequence_;
+			std::vector<std::pair<const IndexedFasta*, size_t> > mappedSequence;
+			for (size_t file = 0; file < record.size(); file++)
+			{
+				if (indexed[file])
+				{
+					for (size_t i = 0; i < indexed[file]->GetRecordNumber(); i++)
 					{
-						position_[chr].back().pointerIdx = 0;
+						const auto & chrRecord = indexed[file]->GetRecord(i);
+						AddSequence(chrRecord.description, chrRecord.length, file);
+						sequence_.push_back(std::string());
+						mappedSequence.push_back(std::make_pair(indexed[file].get(), i));
 					}
+				}
+
+				for (auto & chrRecord : record[file])
+				{
+					AddSequence(chrRecord.description, chrRecord.sequence.size(), file);
+					sequence_.push_back(std::string());
+					sequence_.back().swap(chrRecord.sequence);
+					mappedSequence.push_back(std::make_pair(static_cast<const IndexedFasta*>(0), size_t(0)));
+				}
 
-					prevPos[absId].prevId = junction.GetId();
-					prevPos[absId].prevChr = junction.GetChr();
-					prevPos[absId].prevIdx = position_[junction.GetChr()].size() - 1;
+				std::vector<FastaRecord>().swap(record[file]);
+			}
 
-		
+			AddEmptyChromosomes(sequence_.size());
+			int64_t chrNumber = GetChrNumber();
+			#pragma omp parallel for schedule(dynamic, 1) num_threads(threads)
+			for (int64_t chr = 0; chr < chrNumber; chr++)
+			{
+				const IndexedFasta * mapped = chr < int64_t(mappedSequence.size()) ? mappedSequence[chr].first : 0;
+				if (mapped != 0)
+				{
+					size_t mappedRecord = mappedSequence[chr].second;
+					for (size_t idx = chrStart_[chr]; idx < chrStart_[chr + 1]; idx++)
+					{
+						Index pos = position_.pos[idx];
+						char ch = mapped->GetChar(mappedRecord, pos + k_);
+						char revCh = pos > 0 ? TwoPaCo::DnaChar::ReverseChar(mapped->GetChar(mappedRecord, pos - 1)) : 'N';
+						position_.vertex[idx].chars = EncodeChar(ch) | (EncodeChar(revCh) << 3);
+					}
 				}
+				else
+				{
+					EncodeChars(chr, sequence_[chr]);
+				}
+
+				std::string().swap(sequence_[chr]);
 			}
+
+			indexed.clear();
+			LinkOccurrences(threads, chrSorted, streamOrder);
 		}
 
 		struct Pointer
 		{
 			int32_t chrId;
-			int32_t idx;
+			Index idx;
 
 			Pointer() {}
-			Pointer(int32_t chrId, int32_t idx) : chrId(chrId), idx(idx)
+			Pointer(int32_t chrId, Index idx) : chrId(chrId), idx(idx)
 			{
 
 			}
@@ -320,10 +493,49 @@ namespace Sibelia
 		};
 
 		
-		JunctionStorage() {}
-		JunctionStorage(const std::string & fileName, const std::vector<std::string> & genomesFileName, uint64_t k, int64_t threads, int64_t abundanceThreshold, int64_t loopThreshold) : k_(k), abundance_(abundanceThreshold)
+		JunctionStorage() : chrStart_(1, 0) {}
+		JunctionStorage(const std::string & snapshotFileName, uint64_t k, int64_t abundanceThreshold, bool dropSingletons = false) : k_(k), abundance_(abundanceThreshold), dropSingletons_(dropSingletons), chrStart_(1, 0)
 		{
-			Init(fileName, genomesFileName, threads, abundanceThreshold, loopThreshold);
+			LoadSnapshot(snapshotFileName);
+		}
+
+		JunctionStorage(const std::string & fileName, const std::vector<std::string> & genomesFileName, uint64_t k, int64_t threads, int64_t abundanceThreshold, int64_t loopThreshold, bool mapSequences = false, bool dropSingletons = false) : k_(k), abundance_(abundanceThreshold), chrStart_(1, 0)
+		{
+			Init(fileName, genomesFileName, threads, abundanceThreshold, loopThreshold, mapSequences, dropSingletons);
+		}
+
+		//Builds the storage from junctions held in memory, e.g. of a synthetic
+		//graph. The junctions are given in the order TwoPaCo writes them and
+		//the sequences are indexed by the chromosome of a junction
+		JunctionStorage(const std::vector<TwoPaCo::JunctionPosition> & junction,
+			const std::vector<std::string> & description,
+			const std::vector<std::string> & sequence,
+			const std::vector<size_t> & genome,
+			uint64_t k,
+			int64_t threads,
+			int64_t abundanceThreshold) : k_(k), maxId_(0), abundance_(abundanceThreshold), dropSingletons_(false), chrStart_(1, 0)
+		{
+			bool chrSorted = true;
+			std::vector<Pointer> streamOrder;
+			threads = max(threads, int64_t(1));
+			AddJunctions(junction.data(), junction.size(), threads, chrSorted, streamOrder);
+
+			FilterJunctions(threads, abundanceThreshold, false, chrSorted, streamOrder);
+			chrSorted_ = chrSorted;
+			for (size_t chr = 0; chr < sequence.size(); chr++)
+			{
+				AddSequence(description[chr], sequence[chr].size(), genome[chr]);
+			}
+
+			AddEmptyChromosomes(sequence.size());
+			int64_t chrNumber = sequence.size();
+			#pragma omp parallel for schedule(dynamic, 1) num_threads(threads)
+			for (int64_t chr = 0; chr < chrNumber; chr++)
+			{
+				EncodeChars(chr, sequence[chr]);
+			}
+
+			LinkOccurrences(threads, chrSorted, streamOrder);
 		}
 
 		size_t GetAbundance() const
@@ -331,17 +543,601 @@ namespace Sibelia
 			return abundance_;
 		}
 
+		//The snapshot holds the built storage as it is laid out in memory: a
+		//header with chromosome descriptions, then the columns of the whole
+		//storage, each aligned to SNAPSHOT_ALIGNMENT bytes
+		void SaveSnapshot(const std::string & fileName) const
+		{
+			std::ofstream out(fileName.c_str(), std::ios::binary);
+			WriteValue(out, uint64_t(SNAPSHOT_MAGIC));
+			WriteValue(out, uint64_t(sizeof(Index)));
+			WriteValue(out, uint64_t(sizeof(VertexId)));
+			WriteValue(out, k_);
+			WriteValue(out, uint64_t(abundance_));
+			WriteValue(out, uint64_t(dropSingletons_));
+			WriteValue(out, uint64_t(maxId_));
+			WriteValue(out, uint64_t(chrSorted_));
+			WriteValue(out, uint64_t(GetChrNumber()));
+			for (size_t chr = 0; chr < GetChrNumber(); chr++)
+			{
+				WriteValue(out, uint64_t(sequenceDescription_[chr].size()));
+				out.write(sequenceDescription_[chr].data(), sequenceDescription_[chr].size());
+				WriteValue(out, uint64_t(chrSeqSize_[chr]));
+				WriteValue(out, uint64_t(GetChrGenome(chr)));
+				WriteValue(out, uint64_t(GeChrSize(chr)));
+			}
+
+			WriteColumn(out, position_.pos);
+			WriteColumn(out, position_.vertex);
+			WriteColumn(out, position_.link);
+
+			if (!out)
+			{
+				throw std::runtime_error(("Cannot write the snapshot " + fileName).c_str());
+			}
+		}
+
+		void LoadSnapshot(const std::string & fileName)
+		{
+			snapshot_.reset(new MappedFile(fileName, MADV_NORMAL, true));
+			char * data = snapshot_->GetData();
+			size_t offset = 0;
+			uint64_t indexSize;
+			uint64_t vertexIdSize;
+			uint64_t k;
+			uint64_t abundance;
+			uint64_t dropSingletons;
+			uint64_t maxId;
+			uint64_t chrSorted;
+			uint64_t chrNumber;
+			if (ReadValue<uint64_t>(offset) != SNAPSHOT_MAGIC)
+			{
+				throw std::runtime_error(("Not a snapshot file " + fileName).c_str());
+			}
+
+			indexSize = ReadValue<uint64_t>(offset);
+			vertexIdSize = ReadValue<uint64_t>(offset);
+			k = ReadValue<uint64_t>(offset);
+			abundance = ReadValue<uint64_t>(offset);
+			dropSingletons = ReadValue<uint64_t>(offset);
+			maxId = ReadValue<uint64_t>(offset);
+			chrSorted = ReadValue<uint64_t>(offset);
+			chrNumber = ReadValue<uint64_t>(offset);
+			if (indexSize != sizeof(Index) || vertexIdSize != sizeof(VertexId))
+			{
+				throw std::runtime_error("The snapshot was built with a different coordinate width");
+			}
+
+			if (int64_t(k) != k_)
+			{
+				throw std::runtime_error("The snapshot was built with a different value of k");
+			}
+
+			if (abundance != abundance_ || (dropSingletons != 0) != dropSingletons_)
+			{
+				throw std::runtime_error("The snapshot was built with a different junction filter");
+			}
+
+			maxId_ = maxId;
+			chrSorted_ = chrSorted != 0;
+			chrStart_.assign(1, 0);
+			for (size_t chr = 0; chr < chrNumber; chr++)
+			{
+				size_t descriptionSize = ReadValue<uint64_t>(offset);
+				CheckSnapshotBounds(offset + descriptionSize);
+				AddSequence(std::string(data + offset, data + offset + descriptionSize), 0, 0);
+				offset += descriptionSize;
+				chrSeqSize_.back() = ReadValue<uint64_t>(offset);
+				chrGenome_.back() = ReadValue<uint64_t>(offset);
+				chrStart_.push_back(chrStart_.back() + ReadValue<uint64_t>(offset));
+			}
+
+			AttachColumn(position_.pos, chrStart_.back(), offset);
+			AttachColumn(position_.vertex, chrStart_.back(), offset);
+			AttachColumn(position_.link, chrStart_.back(), offset);
+		}
+
 	private:
 
+		struct FastaRecord
+		{
+			std::string description;
+			std::string sequence;
+		};
+
+		static const size_t SNAPSHOT_ALIGNMENT = 64;
+		static const uint64_t SNAPSHOT_MAGIC = 0x335a424255424253ULL;
+
+		template<class T>
+		static void WriteValue(std::ofstream & out, const T & value)
+		{
+			out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+		}
+
+		template<class T>
+		static void WriteColumn(std::ofstream & out, const Column<T> & column)
+		{
+			for (size_t padding = (SNAPSHOT_ALIGNMENT - size_t(out.tellp()) % SNAPSHOT_ALIGNMENT) % SNAPSHOT_ALIGNMENT; padding > 0; padding--)
+			{
+				out.put(0);
+			}
+
+			out.write(reinterpret_cast<const char*>(column.data()), sizeof(T) * column.size());
+		}
+
+		void CheckSnapshotBounds(size_t end) const
+		{
+			if (end > snapshot_->GetSize())
+			{
+				throw std::runtime_error("The snapshot file is truncated");
+			}
+		}
+
+		template<class T>
+		T ReadValue(size_t & offset) const
+		{
+			T ret;
+			CheckSnapshotBounds(offset + sizeof(T));
+			std::copy(snapshot_->GetData() + offset, snapshot_->GetData() + offset + sizeof(T), reinterpret_cast<char*>(&ret));
+			offset += sizeof(T);
+			return ret;
+		}
+
+		template<class T>
+		void AttachColumn(Column<T> & column, size_t size, size_t & offset)
+		{
+			offset += (SNAPSHOT_ALIGNMENT - offset % SNAPSHOT_ALIGNMENT) % SNAPSHOT_ALIGNMENT;
+			CheckSnapshotBounds(offset + sizeof(T) * size);
+			column.Attach(reinterpret_cast<T*>(snapshot_->GetData() + offset), size);
+			offset += sizeof(T) * size;
+		}
+
+		void AddSequence(const std::string & description, size_t size, size_t genome)
+		{
+			//TwoPaCo stores the positions of junctions in 32 bits
+			if (uint64_t(size) > std::numeric_limits<uint32_t>::max())
+			{
+				throw std::runtime_error(("The sequence " + description + " is longer than 4294967295 bp").c_str());
+			}
+
+			sequenceDescription_.push_back(description);
+			sequenceId_[description] = sequenceDescription_.size() - 1;
+			chrSeqSize_.push_back(size);
+			chrGenome_.push_back(genome);
+		}
+
+		//A piece of the sequence of a record that lies in the range of a thread
+		struct FastaPiece
+		{
+			size_t record;
+			size_t begin;
+			size_t end;
+			size_t offset;
+		};
+
+		//Parses a FASTA file with all threads. The file is mapped and split into
+		//one range per thread, every thread finds the records starting in its
+		//range. Then every thread counts the characters of the records in its
+		//range, the counts give every piece its offset inside the sequence and
+		//the threads copy their pieces in place
+		void ReadFasta(const std::string & fastaFileName, std::vector<FastaRecord> & record, int64_t threads) const
+		{
+			MappedFile file(fastaFileName, MADV_SEQUENTIAL);
+			const char * data = file.GetData();
+			size_t size = file.GetSize();
+			std::vector<std::vector<size_t> > partStart(threads);
+			#pragma omp parallel for schedule(static, 1) num_threads(threads)
+			for (int64_t part = 0; part < threads; part++)
+			{
+				for (size_t i = (size * part) / threads; i < (size * (part + 1)) / threads; i++)
+				{
+					if (data[i] == '>' && (i == 0 || data[i - 1] == '\n'))
+					{
+						partStart[part].push_back(i);
+					}
+				}
+			}
+
+			std::vector<size_t> start;
+			for (int64_t part = 0; part < threads; part++)
+			{
+				start.insert(start.end(), partStart[part].begin(), partStart[part].end());
+			}
+
+			start.push_back(size);
+			std::vector<size_t> sequenceStart;
+			record.assign(start.size() - 1, FastaRecord());
+			for (size_t r = 0; r < record.size(); r++)
+			{
+				const char * end = static_cast<const char*>(memchr(data + start[r], '\n', start[r + 1] - start[r]));
+				size_t headerEnd = end == 0 ? start[r + 1] : end - data;
+				record[r].description.assign(data + start[r] + 1, data + headerEnd);
+				sequenceStart.push_back(end == 0 ? headerEnd : headerEnd + 1);
+			}
+
+			std::vector<std::vector<FastaPiece> > piece(threads);
+			#pragma omp parallel for schedule(static, 1) num_threads(threads)
+			for (int64_t part = 0; part < threads; part++)
+			{
+				size_t from = (size * part) / threads;
+				size_t to = (size * (part + 1)) / threads;
+				size_t r = std::upper_bound(start.begin(), start.end(), from) - start.begin();
+				for (r = r > 0 ? r - 1 : 0; r < record.size() && start[r] < to; r++)
+				{
+					FastaPiece now = { r, max(from, sequenceStart[r]), min(to, start[r + 1]), 0 };
+					for (size_t i = now.begin; i < now.end; i++)
+					{
+						now.offset += data[i] != '\n' && data[i] != '\r';
+					}
+
+					piece[part].push_back(now);
+				}
+			}
+
+			std::vector<size_t> length(record.size(), 0);
+			for (auto & partPiece : piece)
+			{
+				for (auto & now : partPiece)
+				{
+					size_t count = now.offset;
+					now.offset = length[now.record];
+					length[now.record] += count;
+				}
+			}
+
+			for (size_t r = 0; r < record.size(); r++)
+			{
+				record[r].sequence.resize(length[r]);
+			}
+
+			#pragma omp parallel for schedule(static, 1) num_threads(threads)
+			for (int64_t part = 0; part < threads; part++)
+			{
+				for (const auto & now : piece[part])
+				{
+					char * out = &record[now.record].sequence[0] + now.offset;
+					for (size_t i = now.begin; i < now.end; i++)
+					{
+						if (data[i] != '\n' && data[i] != '\r')
+						{
+							*out++ = IndexedFasta::NormalChar(data[i]);
+						}
+					}
+				}
+			}
+		}
+
+		//The records of a graph file are stored as they are laid out in memory,
+		//so the file is mapped and read in place instead of being decoded
+		void ReadJunctions(const std::string & inFileName, int64_t threads, bool & chrSorted, std::vector<Pointer> & streamOrder)
+		{
+			static_assert(sizeof(TwoPaCo::JunctionPosition) == 2 * sizeof(uint32_t) + sizeof(int64_t), "Unexpected junction record layout");
+			MappedFile file(inFileName, MADV_SEQUENTIAL);
+			if (file.GetSize() % sizeof(TwoPaCo::JunctionPosition) != 0)
+			{
+				throw std::runtime_error(("The graph file " + inFileName + " is truncated").c_str());
+			}
+
+			AddJunctions(reinterpret_cast<const TwoPaCo::JunctionPosition*>(file.GetData()), file.GetSize() / sizeof(TwoPaCo::JunctionPosition), threads, chrSorted, streamOrder);
+		}
+
+		//Stores the junctions into the columns of the whole storage. Every
+		//thread takes a range of the records. The first pass counts the
+		//junctions of every chromosome in each range, the counts give every
+		//range its place inside each chromosome, so the second pass writes the
+		//junctions in place and in the order of the records
+		void AddJunctions(const TwoPaCo::JunctionPosition * junction, size_t junctionNumber, int64_t threads, bool & chrSorted, std::vector<Pointer> & streamOrder)
+		{
+			std::vector<size_t> partMaxId(threads, 0);
+			std::vector<char> partSorted(threads, true);
+			std::vector<std::vector<size_t> > count(threads);
+			#pragma omp parallel for schedule(static, 1) num_threads(threads)
+			for (int64_t part = 0; part < threads; part++)
+			{
+				for (size_t i = (junctionNumber * part) / threads; i < (junctionNumber * (part + 1)) / threads; i++)
+				{
+					size_t chr = junction[i].GetChr();
+					partMaxId[part] = max(size_t(abs(junction[i].GetId())), partMaxId[part]);
+					if (chr >= count[part].size())
+					{
+						count[part].resize(chr + 1, 0);
+					}
+
+					partSorted[part] = partSorted[part] && (i == 0 || chr >= junction[i - 1].GetChr());
+					count[part][chr]++;
+				}
+			}
+
+			size_t chrNumber = 0;
+			for (int64_t part = 0; part < threads; part++)
+			{
+				maxId_ = max(partMaxId[part], maxId_);
+				chrSorted = chrSorted && partSorted[part];
+				chrNumber = max(count[part].size(), chrNumber);
+			}
+
+			if (maxId_ > size_t(std::numeric_limits<VertexId>::max()))
+			{
+				throw std::runtime_error("The graph has too many vertices for 32-bit indices");
+			}
+
+			for (int64_t part = 0; part < threads; part++)
+			{
+				count[part].resize(chrNumber, 0);
+			}
+
+			//After this count[part][chr] is where the range of the part starts
+			chrStart_.assign(1, 0);
+			for (size_t chr = 0; chr < chrNumber; chr++)
+			{
+				chrStart_.push_back(chrStart_.back());
+				for (int64_t part = 0; part < threads; part++)
+				{
+					size_t partCount = count[part][chr];
+					count[part][chr] = chrStart_.back() - chrStart_[chr];
+					chrStart_.back() += partCount;
+				}
+			}
+
+			position_.Allocate(chrStart_.back());
+			if (!chrSorted)
+			{
+				streamOrder.resize(junctionNumber);
+			}
+
+			#pragma omp parallel for schedule(static, 1) num_threads(threads)
+			for (int64_t part = 0; part < threads; part++)
+			{
+				for (size_t i = (junctionNumber * part) / threads; i < (junctionNumber * (part + 1)) / threads; i++)
+				{
+					size_t chr = junction[i].GetChr();
+					size_t idx = count[part][chr]++;
+					position_.Set(chrStart_[chr] + idx, junction[i]);
+					if (!chrSorted)
+					{
+						streamOrder[i] = Pointer(chr, idx);
+					}
+				}
+			}
+		}
+
+		//Chromosomes past the last one with junctions get empty ranges
+		void AddEmptyChromosomes(size_t chrNumber)
+		{
+			while (GetChrNumber() < chrNumber)
+			{
+				chrStart_.push_back(chrStart_.back());
+			}
+		}
+
+		void EncodeChars(size_t chr, const std::string & sequence)
+		{
+			for (size_t idx = chrStart_[chr]; idx < chrStart_[chr + 1]; idx++)
+			{
+				Index pos = position_.pos[idx];
+				char ch = sequence[pos + k_];
+				char revCh = pos > 0 ? TwoPaCo::DnaChar::ReverseChar(sequence[pos - 1]) : 'N';
+				position_.vertex[idx].chars = EncodeChar(ch) | (EncodeChar(revCh) << 3);
+			}
+		}
+
+		//Thread part owns the vertices with ids in [idFrom[part], idFrom[part + 1])
+		std::vector<int64_t> GetIdRanges(int64_t threads) const
+		{
+			std::vector<int64_t> idFrom(threads + 1);
+			for (int64_t part = 0; part <= threads; part++)
+			{
+				idFrom[part] = 1 + (maxId_ * part) / threads;
+			}
+
+			return idFrom;
+		}
+
+		static int64_t GetIdOwner(const std::vector<int64_t> & idFrom, int64_t absId)
+		{
+			return std::upper_bound(idFrom.begin(), idFrom.end(), absId) - idFrom.begin() - 1;
+		}
+
+		//Distributes items [0, itemNumber) into the buckets of the threads that
+		//own their vertices. Every thread counts the items of its own range per
+		//bucket, the counts are summed into the offsets of the buckets and the
+		//ranges are scattered in one more pass. So every thread reads about
+		//itemNumber / threads items and a bucket keeps the order of the items.
+		//Every thread calls its own copy of item, which can cache a position
+		template<class T, class Item, class Owner>
+		void Partition(int64_t threads, size_t itemNumber, const Item & item, const Owner & owner, std::vector<T> & bucket, std::vector<size_t> & bucketStart) const
+		{
+			std::vector<std::vector<size_t> > offset(threads, std::vector<size_t>(threads, 0));
+			#pragma omp parallel for schedule(static, 1) num_threads(threads)
+			for (int64_t part = 0; part < threads; part++)
+			{
+				Item nowItem(item);
+				for (size_t i = (itemNumber * part) / threads; i < (itemNumber * (part + 1)) / threads; i++)
+				{
+					offset[part][owner(nowItem(i))]++;
+				}
+			}
+
+			bucketStart.assign(threads + 1, 0);
+			for (int64_t owner = 0; owner < threads; owner++)
+			{
+				bucketStart[owner + 1] = bucketStart[owner];
+				for (int64_t part = 0; part < threads; part++)
+				{
+					size_t count = offset[part][owner];
+					offset[part][owner] = bucketStart[owner + 1];
+					bucketStart[owner + 1] += count;
+				}
+			}
+
+			bucket.resize(itemNumber);
+			#pragma omp parallel for schedule(static, 1) num_threads(threads)
+			for (int64_t part = 0; part < threads; part++)
+			{
+				Item nowItem(item);
+				for (size_t i = (itemNumber * part) / threads; i < (itemNumber * (part + 1)) / threads; i++)
+				{
+					T value = nowItem(i);
+					bucket[offset[part][owner(value)]++] = value;
+				}
+			}
+		}
+
+		//Drops junctions of vertices that occur more than abundanceThreshold
+		//times, or only once if dropSingletons is set, before they are linked
+		void FilterJunctions(int64_t threads, int64_t abundanceThreshold, bool dropSingletons, bool chrSorted, std::vector<Pointer> & streamOrder)
+		{
+			std::vector<VertexId> bucket;
+			std::vector<size_t> bucketStart;
+			std::vector<int64_t> idFrom = GetIdRanges(threads);
+			Partition(threads, position_.size(),
+				[this](size_t idx) { return VertexId(abs(position_.vertex[idx].id)); },
+				[&idFrom](VertexId absId) { return GetIdOwner(idFrom, absId); },
+				bucket, bucketStart);
+
+			std::vector<uint32_t> count(maxId_ + 1, 0);
+			#pragma omp parallel for schedule(static, 1) num_threads(threads)
+			for (int64_t part = 0; part < threads; part++)
+			{
+				for (size_t i = bucketStart[part]; i < bucketStart[part + 1]; i++)
+				{
+					count[bucket[i]]++;
+				}
+			}
+
+			std::vector<VertexId>().swap(bucket);
+
+			uint64_t minCount = dropSingletons ? 2 : 1;
+			int64_t chrNumber = GetChrNumber();
+			std::vector<size_t> kept(chrNumber, 0);
+			std::vector<std::vector<Index> > newIdx(chrSorted ? 0 : chrNumber);
+			#pragma omp parallel for schedule(dynamic, 1) num_threads(threads)
+			for (int64_t chr = 0; chr < chrNumber; chr++)
+			{
+				size_t start = chrStart_[chr];
+				if (!chrSorted)
+				{
+					newIdx[chr].resize(GeChrSize(chr), Index(NO_NEXT));
+				}
+
+				for (size_t idx = 0; idx < GeChrSize(chr); idx++)
+				{
+					uint64_t nowCount = count[abs(position_.vertex[start + idx].id)];
+					if (nowCount >= minCount && nowCount <= uint64_t(abundanceThreshold))
+					{
+						if (!chrSorted)
+						{
+							newIdx[chr][idx] = kept[chr];
+						}
+
+						position_.pos[start + kept[chr]] = position_.pos[start + idx];
+						position_.vertex[start + kept[chr]] = position_.vertex[start + idx];
+						kept[chr]++;
+					}
+				}
+			}
+
+			//Moves the kept junctions of every chromosome next to the previous one
+			for (int64_t chr = 0; chr < chrNumber; chr++)
+			{
+				size_t start = chrStart_[chr];
+				chrStart_[chr] = chr > 0 ? chrStart_[chr - 1] + kept[chr - 1] : 0;
+				std::copy(position_.pos.data() + start, position_.pos.data() + start + kept[chr], position_.pos.data() + chrStart_[chr]);
+				std::copy(position_.vertex.data() + start, position_.vertex.data() + start + kept[chr], position_.vertex.data() + chrStart_[chr]);
+			}
+
+			chrStart_[chrNumber] = chrNumber > 0 ? chrStart_[chrNumber - 1] + kept[chrNumber - 1] : 0;
+			position_.Shrink(chrStart_.back());
+
+			if (!chrSorted)
+			{
+				size_t kept = 0;
+				for (const auto & p : streamOrder)
+				{
+					if (newIdx[p.chrId][p.idx] != NO_NEXT)
+					{
+						streamOrder[kept++] = Pointer(p.chrId, newIdx[p.chrId][p.idx]);
+					}
+				}
+
+				streamOrder.resize(kept);
+			}
+		}
+
+		void LinkOccurrence(std::vector<PrevPosition> & prevPos, int64_t idFrom, size_t chr, size_t idx)
+		{
+			auto & now = position_.vertex[chrStart_[chr] + idx];
+			auto & prev = prevPos[abs(now.id) - idFrom];
+			if (prev.prevId != 0)
+			{
+				size_t prevIdx = chrStart_[prev.prevChr] + prev.prevIdx;
+				auto & prevLink = position_.link[prevIdx];
+				prevLink.nextChr = prev.prevId != now.id ? (chr | INVERT_BIT) : chr;
+				prevLink.nextIdx = idx;
+				now.pointerIdx = position_.vertex[prevIdx].pointerIdx + 1;
+			}
+			else
+			{
+				now.pointerIdx = 0;
+			}
+
+			prev.prevId = now.id;
+			prev.prevChr = chr;
+			prev.prevIdx = idx;
+		}
+
+		//Links the occurrences of every vertex in the order of chromosomes, or
+		//in the order of the graph file if it is not sorted by chromosomes.
+		//The junctions are partitioned by the owners of their vertices first,
+		//so every thread only walks its own occurrences
+		void LinkOccurrences(int64_t threads, bool chrSorted, const std::vector<Pointer> & streamOrder)
+		{
+			std::vector<Pointer> bucket;
+			std::vector<size_t> bucketStart;
+			std::vector<int64_t> idFrom = GetIdRanges(threads);
+			auto owner = [this, &idFrom](const Pointer & p) { return GetIdOwner(idFrom, abs(position_.vertex[chrStart_[p.chrId] + p.idx].id)); };
+			if (chrSorted)
+			{
+				size_t chr = 0;
+				Partition(threads, position_.size(), [this, chr](size_t idx) mutable
+				{
+					if (idx < chrStart_[chr] || idx >= chrStart_[chr + 1])
+					{
+						chr = std::upper_bound(chrStart_.begin(), chrStart_.end(), idx) - chrStart_.begin() - 1;
+					}
+
+					return Pointer(chr, idx - chrStart_[chr]);
+				}, owner, bucket, bucketStart);
+			}
+			else
+			{
+				Partition(threads, streamOrder.size(), [&streamOrder](size_t i) { return streamOrder[i]; }, owner, bucket, bucketStart);
+			}
+
+			#pragma omp parallel for schedule(static, 1) num_threads(threads)
+			for (int64_t part = 0; part < threads; part++)
+			{
+				std::vector<PrevPosition> prevPos(idFrom[part + 1] - idFrom[part]);
+				for (size_t i = bucketStart[part]; i < bucketStart[part + 1]; i++)
+				{
+					LinkOccurrence(prevPos, idFrom[part], bucket[i].chrId, bucket[i].idx);
+				}
+			}
+		}
 
 		int64_t k_;
 		size_t maxId_;
 		size_t abundance_;
+		bool chrSorted_;
+		bool dropSingletons_;
 		std::map<std::string, size_t> sequenceId_;
 		std::vector<size_t> chrSeqSize_;
+		std::vector<uint32_t> chrGenome_;
 		std::vector<std::string> sequenceDescription_;
-		std::vector<std::vector<Position> > position_;
-		static JunctionStorage * this_;
+		//Chromosome chr occupies [chrStart_[chr], chrStart_[chr + 1]) of position_
+		PositionColumns position_;
+		std::vector<size_t> chrStart_;
+		std::unique_ptr<MappedFile> snapshot_;
 		friend class Iterator;
 	};
 }
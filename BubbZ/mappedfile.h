@@ -0,0 +1,190 @@
+#ifndef _MAPPED_FILE_H_
+#define _MAPPED_FILE_H_
+
+#include <new>
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef _MSC_VER
+	#include <xmmintrin.h>
+#endif
+
+namespace Sibelia
+{
+	//Asks the processor to load the cache line of the address in advance
+	inline void Prefetch(const void * address)
+	{
+#ifdef _MSC_VER
+		_mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#else
+		__builtin_prefetch(address);
+#endif
+	}
+
+	//A read-only view of a whole file. Writable mappings are private, so the
+	//pages stay shared with other processes until they are modified. It can
+	//also hold anonymous memory, see Allocate.
+	class MappedFile
+	{
+	public:
+		MappedFile() : data_(0), size_(0)
+		{
+
+		}
+
+		MappedFile(const std::string & fileName, int advice = MADV_NORMAL, bool writable = false) : data_(0), size_(0)
+		{
+			Open(fileName, advice, writable);
+		}
+
+		~MappedFile()
+		{
+			if (data_ != 0)
+			{
+				munmap(data_, size_);
+			}
+		}
+
+		void Open(const std::string & fileName, int advice = MADV_NORMAL, bool writable = false)
+		{
+			int fd = open(fileName.c_str(), O_RDONLY);
+			struct stat fileStat;
+			if (fd == -1 || fstat(fd, &fileStat) != 0)
+			{
+				throw std::runtime_error(("Cannot open file " + fileName).c_str());
+			}
+
+			size_ = fileStat.st_size;
+			if (size_ > 0)
+			{
+				void * data = mmap(0, size_, PROT_READ | (writable ? PROT_WRITE : 0), MAP_PRIVATE, fd, 0);
+				if (data == MAP_FAILED)
+				{
+					close(fd);
+					throw std::runtime_error(("Cannot map file " + fileName).c_str());
+				}
+
+				madvise(data, size_, advice);
+				data_ = static_cast<char*>(data);
+			}
+
+			close(fd);
+		}
+
+		//Maps zeroed anonymous memory. The pages are advised to be huge ones
+		//before anything touches them, which saves TLB misses on random
+		//accesses to big arrays
+		void Allocate(size_t size)
+		{
+			size_ = size;
+			if (size_ > 0)
+			{
+				void * data = mmap(0, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (data == MAP_FAILED)
+				{
+					throw std::bad_alloc();
+				}
+
+#ifdef MADV_HUGEPAGE
+				madvise(data, size_, MADV_HUGEPAGE);
+#endif
+				data_ = static_cast<char*>(data);
+			}
+		}
+
+		char * GetData() const
+		{
+			return data_;
+		}
+
+		size_t GetSize() const
+		{
+			return size_;
+		}
+
+		static bool IsNewer(const std::string & fileName, const std::string & thanFileName)
+		{
+			struct stat fileStat;
+			struct stat thanStat;
+			return stat(fileName.c_str(), &fileStat) == 0 && stat(thanFileName.c_str(), &thanStat) == 0 && fileStat.st_mtime >= thanStat.st_mtime;
+		}
+
+	private:
+		MappedFile(const MappedFile &);
+		MappedFile & operator = (const MappedFile &);
+
+		char * data_;
+		size_t size_;
+	};
+
+	//An array that either owns its elements in anonymous memory or views
+	//memory owned by someone else, e.g. a MappedFile. Copies share the memory.
+	template<class T>
+	class Column
+	{
+	public:
+		Column() : data_(0), size_(0)
+		{
+
+		}
+
+		void Attach(T * data, size_t size)
+		{
+			memory_.reset();
+			data_ = data;
+			size_ = size;
+		}
+
+		//The elements are zeroed, the memory is only touched when they are set
+		void Allocate(size_t size)
+		{
+			std::shared_ptr<MappedFile> memory(new MappedFile());
+			memory->Allocate(size * sizeof(T));
+			Attach(reinterpret_cast<T*>(memory->GetData()), size);
+			memory_ = memory;
+		}
+
+		//Drops the elements past size, the memory is kept
+		void Shrink(size_t size)
+		{
+			size_ = std::min(size_, size);
+		}
+
+		size_t size() const
+		{
+			return size_;
+		}
+
+		T * data() const
+		{
+			return data_;
+		}
+
+		T & operator [] (size_t idx)
+		{
+			return data_[idx];
+		}
+
+		const T & operator [] (size_t idx) const
+		{
+			return data_[idx];
+		}
+
+	private:
+		std::shared_ptr<MappedFile> memory_;
+		T * data_;
+		size_t size_;
+	};
+}
+
+#endif
@@ -2,6 +2,7 @@
 #define _PATH_H_
 
 #include <set>
+#include <memory>
 #include <cassert>
 #include <algorithm>
 #include "distancekeeper.h"
@@ -15,21 +16,25 @@
 
 namespace Sibelia
 {
+	template<class Width>
 	struct Instance
 	{
+		typedef typename Width::Coordinate Coordinate;
+		typedef typename JunctionStorage<Width>::Iterator Iterator;
+
 		bool hasNext;
-		int32_t idx;
+		Coordinate idx;
 		int32_t chrId;
 		uint32_t score;
-		int32_t endPosition[2];
-		int32_t startPosition[2];
+		Coordinate endPosition[2];
+		Coordinate startPosition[2];
 
 		Instance() : hasNext(false),  score(1)
 		{
 
 		}
 
-		Instance(int32_t chrId, int32_t idx) : chrId(chrId), idx(idx)
+		Instance(int32_t chrId, Coordinate idx) : chrId(chrId), idx(idx)
 		{
 
 		}
@@ -47,23 +52,23 @@ namespace Sibelia
 			return true;
 		}
 
-		Instance(const Instance & inst, JunctionStorage::Iterator & it, JunctionStorage::Iterator & jt) : hasNext(false), score(inst.score + 1)
+		Instance(const Instance & inst, Iterator & it, Iterator & jt) : hasNext(false), score(inst.score + 1)
 		{
 			startPosition[0] = inst.startPosition[0];
 			startPosition[1] = inst.startPosition[1];
 			endPosition[0] = it.GetPosition();
 			endPosition[1] = jt.GetPosition();
 			
-			idx = static_cast<int32_t>(jt.GetIndex());
+			idx = static_cast<Coordinate>(jt.GetIndex());
 			chrId = jt.IsPositiveStrand() ? (jt.GetChrId() + 1) : -(jt.GetChrId() + 1);
 		}
 
-		Instance(JunctionStorage::Iterator & it, JunctionStorage::Iterator & jt) : hasNext(false)
+		Instance(Iterator & it, Iterator & jt) : hasNext(false)
 		{
 			startPosition[0] = endPosition[0] = it.GetPosition();
 			startPosition[1] = endPosition[1] = jt.GetPosition();
 
-			idx = static_cast<int32_t>(jt.GetIndex());
+			idx = static_cast<Coordinate>(jt.GetIndex());
 			chrId = jt.IsPositiveStrand() ? (jt.GetChrId() + 1) : -(jt.GetChrId() + 1);
 		}
 
@@ -91,32 +96,226 @@ namespace Sibelia
 		}
 	};
 
+	template<class Width>
 	struct VertexEntry
 	{
 		int64_t vertexId;
 		uint16_t pointerIdx;
-		std::vector<Instance>* instance;
+		std::vector<Instance<Width> >* instance;
 
 		VertexEntry() {}
-		VertexEntry(int64_t vertexId, uint16_t pointerIdx, std::vector<Instance>* instance) : vertexId(vertexId), pointerIdx(pointerIdx), instance(instance)
+		VertexEntry(int64_t vertexId, uint16_t pointerIdx, std::vector<Instance<Width> >* instance) : vertexId(vertexId), pointerIdx(pointerIdx), instance(instance)
+		{
+
+		}
+	};
+
+	//Counters of the sweeps. Every thread keeps its own copy, the copies are
+	//added up after the sweeps
+	struct SweepStats
+	{
+		uint64_t pairs;
+		uint64_t exactHits;
+		uint64_t bestSearches;
+		uint64_t bestHits;
+		uint64_t wordsScanned;
+		uint64_t lookups;
+		uint64_t lookupMisses;
+		uint64_t blocksReported;
+		uint64_t chainsFiltered;
+		uint64_t peakPurge;
+
+		SweepStats() : pairs(0), exactHits(0), bestSearches(0), bestHits(0), wordsScanned(0), lookups(0), lookupMisses(0), blocksReported(0), chainsFiltered(0), peakPurge(0)
+		{
+
+		}
+
+		void Add(const SweepStats & stats)
+		{
+			pairs += stats.pairs;
+			exactHits += stats.exactHits;
+			bestSearches += stats.bestSearches;
+			bestHits += stats.bestHits;
+			wordsScanned += stats.wordsScanned;
+			lookups += stats.lookups;
+			lookupMisses += stats.lookupMisses;
+			blocksReported += stats.blocksReported;
+			chainsFiltered += stats.chainsFiltered;
+			peakPurge = std::max(peakPurge, stats.peakPurge);
+		}
+	};
+
+	//Maps a signed vertex id to its latest entry in the sweep window. The
+	//window never holds more than maxBranchSize + 1 entries, so a small open
+	//addressing table replaces arrays indexed by every vertex of the graph
+	template<class Width>
+	class VertexEntryIndex
+	{
+	public:
+		typedef Sibelia::VertexEntry<Width> VertexEntry;
+
+		VertexEntryIndex(size_t maxEntries)
+		{
+			size_t capacity = 1;
+			for (shift_ = 64; capacity < maxEntries * 4; capacity <<= 1, shift_--);
+			mask_ = capacity - 1;
+			slot_.resize(capacity);
+		}
+
+		VertexEntry* Get(int64_t vid) const
+		{
+			for (size_t i = Hash(vid); ; i = (i + 1) & mask_)
+			{
+				if (slot_[i].vertexId == vid)
+				{
+					return slot_[i].entry;
+				}
+
+				if (slot_[i].vertexId == 0)
+				{
+					return 0;
+				}
+			}
+		}
+
+		void Set(int64_t vid, VertexEntry * e)
+		{
+			size_t i = Hash(vid);
+			for (; slot_[i].vertexId != 0 && slot_[i].vertexId != vid; i = (i + 1) & mask_);
+			slot_[i].vertexId = vid;
+			slot_[i].entry = e;
+		}
+
+		//Removes the vertex only if it still points to e. The following
+		//slots of the cluster are shifted back, so no tombstones are needed
+		void Erase(int64_t vid, const VertexEntry * e)
+		{
+			size_t i = Hash(vid);
+			for (; slot_[i].vertexId != vid; i = (i + 1) & mask_)
+			{
+				if (slot_[i].vertexId == 0)
+				{
+					return;
+				}
+			}
+
+			if (slot_[i].entry != e)
+			{
+				return;
+			}
+
+			for (size_t j = (i + 1) & mask_; slot_[j].vertexId != 0; j = (j + 1) & mask_)
+			{
+				size_t home = Hash(slot_[j].vertexId);
+				if (((j - home) & mask_) >= ((j - i) & mask_))
+				{
+					slot_[i] = slot_[j];
+					i = j;
+				}
+			}
+
+			slot_[i] = Slot();
+		}
+
+		void Prefetch(int64_t vid) const
 		{
+			Sibelia::Prefetch(&slot_[Hash(vid)]);
+		}
 
+		size_t GetMemoryUsage() const
+		{
+			return slot_.size() * sizeof(Slot);
+		}
+
+	private:
+		struct Slot
+		{
+			int64_t vertexId;
+			VertexEntry * entry;
+			Slot() : vertexId(0), entry(0) {}
+		};
+
+		size_t mask_;
+		size_t shift_;
+		std::vector<Slot> slot_;
+
+		size_t Hash(int64_t vid) const
+		{
+			return shift_ < 64 ? size_t((uint64_t(vid) * 0x9E3779B97F4A7C15ULL) >> shift_) : 0;
 		}
 	};
 
+	//Bitmap pages shared by the instance sets of one thread. Pages come back
+	//zeroed, so a set only has to hand its touched pages back after a sweep
+	class BitmapPool
+	{
+	public:
+		static const size_t PAGE_SHIFT = 6;
+		static const size_t PAGE_WORDS = size_t(1) << PAGE_SHIFT;
+
+		uint64_t * Get()
+		{
+			if (free_.empty())
+			{
+				page_.emplace_back(new uint64_t[PAGE_WORDS]());
+				free_.push_back(page_.back().get());
+			}
+
+			uint64_t * ret = free_.back();
+			free_.pop_back();
+			return ret;
+		}
+
+		void Put(uint64_t * page)
+		{
+			std::fill(page, page + PAGE_WORDS, uint64_t(0));
+			free_.push_back(page);
+		}
+
+		size_t GetMemoryUsage() const
+		{
+			return page_.size() * PAGE_WORDS * sizeof(uint64_t);
+		}
+
+	private:
+		std::vector<uint64_t*> free_;
+		std::vector<std::unique_ptr<uint64_t[]> > page_;
+	};
+
+	template<class Width>
 	class InstanceSet
 	{
 	public:
-		InstanceSet()
+		typedef Sibelia::Instance<Width> Instance;
+		typedef Sibelia::VertexEntry<Width> VertexEntry;
+		typedef Sibelia::VertexEntryIndex<Width> VertexEntryIndex;
+		typedef Sibelia::JunctionStorage<Width> JunctionStorage;
+
+		//The sets of a thread that took pages from the pool since the last
+		//reset, so a sweep only has to reset the sets it touched
+		typedef std::vector<InstanceSet*> DirtyList;
+
+		InstanceSet() : words_(0), pool_(0), dirty_(0), stats_(0)
 		{
 
 		}
 
-		void Init(size_t chr1, bool isPositiveStrand, size_t chrSize)
+		//The bitmap is split into pages that are taken from the pool on the
+		//first Add and returned by Reset
+		void Init(size_t chr1, bool isPositiveStrand, size_t chrSize, BitmapPool & pool, DirtyList & dirty, SweepStats & stats)
 		{
 			chr1_ = chr1;
 			isPositiveStrand_ = isPositiveStrand;
-			isActive_.resize((chrSize >> 6) + 1, false);
+			words_ = (chrSize >> 6) + 1;
+			pool_ = &pool;
+			dirty_ = &dirty;
+			stats_ = &stats;
+		}
+
+		//The page directory and the summaries, the pages belong to the pool
+		size_t GetMemoryUsage() const
+		{
+			return page_.capacity() * sizeof(uint64_t*) + touched_.capacity() * sizeof(size_t) + (wordMask_.capacity() + pageMask_.capacity()) * sizeof(uint64_t);
 		}
 
 		void Add(Instance * inst, size_t idx)
@@ -124,21 +323,66 @@ namespace Sibelia
 			uint64_t bit;
 			uint64_t element;
 			GetCoord(idx, element, bit);
-			isActive_[element] |= uint64_t(1) << uint64_t(bit);
+			if (page_.empty())
+			{
+				page_.resize((words_ >> BitmapPool::PAGE_SHIFT) + 1, 0);
+				wordMask_.resize(page_.size(), 0);
+				pageMask_.resize((page_.size() >> 6) + 1, 0);
+			}
+
+			size_t p = element >> BitmapPool::PAGE_SHIFT;
+			uint64_t *& page = page_[p];
+			if (page == 0)
+			{
+				if (touched_.empty())
+				{
+					dirty_->push_back(this);
+				}
+
+				page = pool_->Get();
+				touched_.push_back(p);
+			}
+
+			page[element & (BitmapPool::PAGE_WORDS - 1)] |= uint64_t(1) << uint64_t(bit);
+			wordMask_[p] |= uint64_t(1) << (element & (BitmapPool::PAGE_WORDS - 1));
+			pageMask_[p >> 6] |= uint64_t(1) << (p & 63);
+		}
+
+		void Reset()
+		{
+			for (size_t p : touched_)
+			{
+				pool_->Put(page_[p]);
+				page_[p] = 0;
+				wordMask_[p] = 0;
+				pageMask_[p >> 6] = 0;
+			}
+
+			touched_.clear();
+		}
+
+		static void Reset(DirtyList & dirty)
+		{
+			for (InstanceSet * set : dirty)
+			{
+				set->Reset();
+			}
+
+			dirty.clear();
 		}
 
-		Instance* Retreive(const JunctionStorage & storage, std::vector<VertexEntry* >& lastPosEntry, std::vector<VertexEntry* > &lastNegEntry, int32_t maxBranchSize, size_t chr0, int32_t chr1idx)
+		Instance* Retreive(const JunctionStorage & storage, VertexEntryIndex & lastEntry, int32_t maxBranchSize, size_t chr0, int64_t chr1idx)
 		{
 			uint64_t bit;
 			uint64_t element;
 			GetCoord(chr1idx, element, bit);
-			int32_t maxBranchSizeElement = (maxBranchSize >> 6) + 1;
+			int64_t maxBranchSizeElement = (maxBranchSize >> 6) + 1;
 			if (isPositiveStrand_)
 			{
-				int32_t elementLimit = max(0, int32_t(element) - maxBranchSizeElement);
-				for (int32_t e = element; e >= elementLimit; e--)
+				int64_t elementLimit = max(int64_t(0), int64_t(element) - maxBranchSizeElement);
+				for (int64_t e = element; e >= elementLimit; e = PrevWord(e - 1, elementLimit))
 				{
-					auto mask = isActive_[e];
+					auto mask = GetWord(e);
 					if (e == element && bit < 63)
 					{
 						auto application = (uint64_t(1) << (bit + uint64_t(1)));
@@ -147,16 +391,16 @@ namespace Sibelia
 
 					if (mask != 0)
 					{
-						return GetInstanceBefore(storage, lastPosEntry, lastNegEntry, chr0, e, mask);
+						return GetInstanceBefore(storage, lastEntry, chr0, e, mask);
 					}
 				}
 			}
 			else
 			{
-				int32_t elementLimit = min(int32_t(isActive_.size()), int32_t(element) + maxBranchSizeElement);
-				for (int32_t e = element; e < elementLimit; e++)
+				int64_t elementLimit = min(int64_t(words_), int64_t(element) + maxBranchSizeElement);
+				for (int64_t e = element; e < elementLimit; e = NextWord(e + 1, elementLimit))
 				{
-					auto mask = isActive_[e];
+					auto mask = GetWord(e);
 					if (e == element)
 					{
 						auto application = (uint64_t(1) << bit) - uint64_t(1);
@@ -165,7 +409,7 @@ namespace Sibelia
 
 					if (mask != 0)
 					{
-						return GetInstanceAfter(storage, lastPosEntry, lastNegEntry, chr0, e, mask);
+						return GetInstanceAfter(storage, lastEntry, chr0, e, mask);
 					}
 				}
 			}
@@ -173,7 +417,7 @@ namespace Sibelia
 			return 0;
 		}
 
-		uint32_t Compatible(const Instance & inst, const JunctionStorage::Iterator succ[2], int64_t maxBranchSize) const
+		uint32_t Compatible(const Instance & inst, const typename JunctionStorage::Iterator succ[2], int64_t maxBranchSize) const
 		{
 			bool withinBubble = true;
 			for (size_t i = 0; i < 2; i++)
@@ -206,7 +450,7 @@ namespace Sibelia
 		}
 
 
-		uint32_t CompatibleExact(const Instance & inst, const JunctionStorage::Iterator succ[2], int64_t maxBranchSize) const
+		uint32_t CompatibleExact(const Instance & inst, const typename JunctionStorage::Iterator succ[2], int64_t maxBranchSize) const
 		{
 			if (succ[0].GetChrId() == succ[1].GetChrId())
 			{
@@ -222,10 +466,9 @@ namespace Sibelia
 		}
 
 		std::pair<Instance*, uint32_t> TryRetreiveExact(const JunctionStorage & storage,
-			std::vector<VertexEntry* >& lastPosEntry,
-			std::vector<VertexEntry* >&lastNegEntry,
-			const JunctionStorage::Iterator succ[2],
-			JunctionStorage::Iterator chr0Prev)
+			VertexEntryIndex & lastEntry,
+			const typename JunctionStorage::Iterator succ[2],
+			typename JunctionStorage::Iterator chr0Prev)
 		{
 
 			Instance* ret = 0;
@@ -236,7 +479,7 @@ namespace Sibelia
 				chr1Prev.DecInSequence();
 				if (chr1Prev.Valid() && chr0Prev.GetChar() == chr1Prev.GetChar())
 				{
-					auto inst = GetMagicIndex(storage, lastPosEntry, lastNegEntry, chr1Prev.GetIndex());
+					auto inst = GetMagicIndex(storage, lastEntry, chr1Prev.GetIndex());
 					if (inst != 0)
 					{
 						auto gapScore = CompatibleExact(*inst, succ, 0);
@@ -251,127 +494,252 @@ namespace Sibelia
 			return std::pair<Instance*, uint32_t>(0, 0);
 		}
 
+		//The candidates are collected from the bitmap in the order of the scan
+		//and evaluated in batches. The positions of the candidates only grow
+		//farther from succ[1] during the scan, and an instance ends at the
+		//position of its candidate, so the scan stops at the first candidate
+		//out of the branch without looking its instance up
 		std::pair<Instance*, uint32_t> RetreiveBest(const JunctionStorage & storage,
-			std::vector<VertexEntry* >& lastPosEntry,
-			std::vector<VertexEntry* >&lastNegEntry,
+			VertexEntryIndex & lastEntry,
 			int32_t maxBranchSize,
-			const JunctionStorage::Iterator succ[2])
+			const typename JunctionStorage::Iterator succ[2])
 		{
 			
 			uint64_t bit;
 			uint64_t element;
 			Instance* ret = 0;
 			uint32_t bestScore = 0;
+			bool go = true;
+			size_t batchSize = 0;
+			Candidate batch[BATCH_SIZE];
 			GetCoord(succ[1].GetIndex(), element, bit);
-			int32_t maxBranchSizeElement = (maxBranchSize >> 6) + 1;
+			int64_t maxBranchSizeElement = (maxBranchSize >> 6) + 1;
 			if (isPositiveStrand_)
 			{
-				bool go = true;
-				int32_t elementLimit = max(0, int32_t(element) - maxBranchSizeElement);
-				for (int32_t e = element; e >= elementLimit && go; e--)
+				int64_t elementLimit = max(int64_t(0), int64_t(element) - maxBranchSizeElement);
+				for (int64_t e = element; e >= elementLimit && go; e = PrevWord(e - 1, elementLimit))
 				{
-					auto mask = isActive_[e];
+					auto mask = GetWord(e);
 					if (e == element && bit < 63)
 					{
 						auto application = (uint64_t(1) << (bit + uint64_t(1)));
 						mask = mask & (application - uint64_t(1));
 					}
 
-					while (mask > 0)
+					while (mask != 0 && go)
 					{
-#ifdef _MSC_VER
-						uint64_t bit = 64 - __lzcnt64(mask);
-#else
-						uint64_t bit = 64 - __builtin_clzll(mask);
-#endif
-						auto idx = (e << 6) | (bit - 1);
-						mask &= ~(uint64_t(1) << (bit - 1));
+						int64_t bit = HighestBit(mask);
+						mask &= ~(uint64_t(1) << bit);
+						size_t idx = (e << 6) | bit;
+						if (succ[1].GetPosition() - GetPosition(storage, idx) >= maxBranchSize)
+						{
+							go = false;
+							break;
+						}
 
-						auto inst = GetMagicIndex(storage, lastPosEntry, lastNegEntry, idx);
-						if (inst != 0)
+						storage.PrefetchVertex(chr1_, idx);
+						batch[batchSize++].idx = idx;
+						if (batchSize == BATCH_SIZE)
 						{
-							if (succ[1].GetPosition() - inst->endPosition[1] >= maxBranchSize)
-							{
-								go = false;
-								break;
-							}
-
-							auto gapScore = Compatible(*inst, succ, maxBranchSize);
-							if (gapScore > 0 && (ret == 0 || (inst->score + gapScore > bestScore)))
-							{
-								ret = inst;
-								bestScore = inst->score + gapScore;
-							}
+							EvaluateBatch(storage, lastEntry, maxBranchSize, succ, batch, batchSize, ret, bestScore);
+							batchSize = 0;
 						}
 					}
 				}
 			}
 			else
 			{
-				bool go = true;
-				int32_t elementLimit = min(int32_t(isActive_.size()), int32_t(element) + maxBranchSizeElement);
-				for (int32_t e = element; e < elementLimit && go; e++)
+				int64_t elementLimit = min(int64_t(words_), int64_t(element) + maxBranchSizeElement);
+				for (int64_t e = element; e < elementLimit && go; e = NextWord(e + 1, elementLimit))
 				{
-					auto mask = isActive_[e];
+					auto mask = GetWord(e);
 					if (e == element)
 					{
 						auto application = (uint64_t(1) << bit) - uint64_t(1);
 						mask = mask & (~application);
 					}
 
-					while (mask != 0)
+					while (mask != 0 && go)
 					{
-#ifdef _MSC_VER
-						uint64_t bit = _tzcnt_u64(mask);
-#else
-						uint64_t bit = __builtin_ctzll(mask);
-#endif
-						auto idx = (e << 6) | bit;
-
+						int64_t bit = LowestBit(mask);
 						mask &= ~(uint64_t(1) << bit);
+						size_t idx = (e << 6) | bit;
+						if (GetPosition(storage, idx) - succ[1].GetPosition() >= maxBranchSize)
+						{
+							go = false;
+							break;
+						}
 
-						auto inst = GetMagicIndex(storage, lastPosEntry, lastNegEntry, idx);
-						if (inst != 0)
+						storage.PrefetchVertex(chr1_, idx);
+						batch[batchSize++].idx = idx;
+						if (batchSize == BATCH_SIZE)
 						{
-							if (inst->endPosition[1] - succ[1].GetPosition() >= maxBranchSize)
-							{
-								go = false;
-								break;
-							}
-
-							auto gapScore = Compatible(*inst, succ, maxBranchSize);
-							if (gapScore > 0 && (ret == 0 || (inst->score + gapScore > bestScore)))
-							{
-								ret = inst;
-								bestScore = inst->score + gapScore;
-							}							
+							EvaluateBatch(storage, lastEntry, maxBranchSize, succ, batch, batchSize, ret, bestScore);
+							batchSize = 0;
 						}
 					}
 				}
 			}
 
+			if (batchSize > 0)
+			{
+				EvaluateBatch(storage, lastEntry, maxBranchSize, succ, batch, batchSize, ret, bestScore);
+			}
+
 			return std::make_pair(ret, bestScore);
 		}
 
-		void Erase(Instance * inst, const JunctionStorage & storage, std::vector<VertexEntry* >& lastPosEntry, std::vector<VertexEntry* > &lastNegEntry, int32_t maxBranchSize, size_t chr0, int32_t chr1idx)
+		void Erase(Instance * inst, const JunctionStorage & storage, VertexEntryIndex & lastEntry, int32_t maxBranchSize, size_t chr0, int64_t chr1idx)
 		{
-			auto * currentInst = Retreive(storage, lastPosEntry, lastNegEntry, maxBranchSize, chr0, chr1idx);
+			auto * currentInst = Retreive(storage, lastEntry, maxBranchSize, chr0, chr1idx);
 			if (currentInst == inst)
 			{
 				uint64_t bit;
 				uint64_t element;
 				GetCoord(chr1idx, element, bit);
-				isActive_[element] &= ~(uint64_t(1) << bit);
+				size_t p = element >> BitmapPool::PAGE_SHIFT;
+				uint64_t & word = page_[p][element & (BitmapPool::PAGE_WORDS - 1)];
+				word &= ~(uint64_t(1) << bit);
+				if (word == 0)
+				{
+					wordMask_[p] &= ~(uint64_t(1) << (element & (BitmapPool::PAGE_WORDS - 1)));
+					if (wordMask_[p] == 0)
+					{
+						pageMask_[p >> 6] &= ~(uint64_t(1) << (p & 63));
+					}
+				}
 			}
 		}
 
 	private:
+		static const size_t BATCH_SIZE = 16;
+
+		struct Candidate
+		{
+			size_t idx;
+			int64_t vid;
+			VertexEntry * entry;
+			Instance * inst;
+		};
+
 		size_t chr1_;
 		bool isPositiveStrand_;
-		std::vector<uint64_t> isActive_;
-		
+		size_t words_;
+		BitmapPool * pool_;
+		DirtyList * dirty_;
+		SweepStats * stats_;
+		std::vector<size_t> touched_;
+		std::vector<uint64_t*> page_;
+		//The summaries of the bitmap: a bit of wordMask_ is set if the word of
+		//the page is not zero, a bit of pageMask_ if the page has such words.
+		//They let the scans skip the empty words and pages
+		std::vector<uint64_t> wordMask_;
+		std::vector<uint64_t> pageMask_;
+
+		static uint64_t BitsUpTo(uint64_t bit)
+		{
+			return bit < 63 ? (uint64_t(1) << (bit + 1)) - 1 : ~uint64_t(0);
+		}
+
+		static uint64_t BitsFrom(uint64_t bit)
+		{
+			return ~((uint64_t(1) << bit) - 1);
+		}
+
+		static int64_t HighestBit(uint64_t mask)
+		{
+#ifdef _MSC_VER
+			return 63 - __lzcnt64(mask);
+#else
+			return 63 - __builtin_clzll(mask);
+#endif
+		}
+
+		static int64_t LowestBit(uint64_t mask)
+		{
+#ifdef _MSC_VER
+			return _tzcnt_u64(mask);
+#else
+			return __builtin_ctzll(mask);
+#endif
+		}
+
+		//The last nonzero word in [limit, e], or limit - 1 if there is none
+		int64_t PrevWord(int64_t e, int64_t limit) const
+		{
+			if (e < limit || wordMask_.empty())
+			{
+				return limit - 1;
+			}
+
+			int64_t p = e >> BitmapPool::PAGE_SHIFT;
+			uint64_t mask = wordMask_[p] & BitsUpTo(e & (BitmapPool::PAGE_WORDS - 1));
+			if (mask == 0)
+			{
+				int64_t limitPage = limit >> BitmapPool::PAGE_SHIFT;
+				for (p--; p >= limitPage; p = (p & ~int64_t(63)) - 1)
+				{
+					uint64_t pages = pageMask_[p >> 6] & BitsUpTo(p & 63);
+					if (pages != 0)
+					{
+						p = (p & ~int64_t(63)) | HighestBit(pages);
+						break;
+					}
+				}
 
-		Instance* GetMagicIndex(const JunctionStorage & storage, std::vector<VertexEntry* > & lastPosEntry, std::vector<VertexEntry* > & lastNegEntry, size_t chr1Idx) const
+				if (p < limitPage)
+				{
+					return limit - 1;
+				}
+
+				mask = wordMask_[p];
+			}
+
+			return max((p << BitmapPool::PAGE_SHIFT) | HighestBit(mask), limit - 1);
+		}
+
+		//The first nonzero word in [e, limit), or limit if there is none
+		int64_t NextWord(int64_t e, int64_t limit) const
+		{
+			if (e >= limit || wordMask_.empty())
+			{
+				return limit;
+			}
+
+			int64_t p = e >> BitmapPool::PAGE_SHIFT;
+			uint64_t mask = wordMask_[p] & BitsFrom(e & (BitmapPool::PAGE_WORDS - 1));
+			if (mask == 0)
+			{
+				int64_t limitPage = (limit - 1) >> BitmapPool::PAGE_SHIFT;
+				for (p++; p <= limitPage; p = (p | 63) + 1)
+				{
+					uint64_t pages = pageMask_[p >> 6] & BitsFrom(p & 63);
+					if (pages != 0)
+					{
+						p = (p & ~int64_t(63)) | LowestBit(pages);
+						break;
+					}
+				}
+
+				if (p > limitPage)
+				{
+					return limit;
+				}
+
+				mask = wordMask_[p];
+			}
+
+			return min((p << BitmapPool::PAGE_SHIFT) | LowestBit(mask), limit);
+		}
+
+		uint64_t GetWord(uint64_t element) const
+		{
+			stats_->wordsScanned++;
+			size_t p = element >> BitmapPool::PAGE_SHIFT;
+			return p < page_.size() && page_[p] != 0 ? page_[p][element & (BitmapPool::PAGE_WORDS - 1)] : 0;
+		}
+
+		Instance* GetMagicIndex(const JunctionStorage & storage, VertexEntryIndex & lastEntry, size_t chr1Idx) const
 		{
 			int64_t vid = storage.GetVertexId(chr1_, chr1Idx);
 			if (!isPositiveStrand_)
@@ -379,9 +747,11 @@ namespace Sibelia
 				vid = -vid;
 			}
 
-			VertexEntry* e = vid > 0 ? lastPosEntry[vid] : lastNegEntry[-vid];
+			stats_->lookups++;
+			VertexEntry* e = lastEntry.Get(vid);
 			if (e == 0)
 			{
+				stats_->lookupMisses++;
 				return 0;
 			}
 
@@ -392,10 +762,73 @@ namespace Sibelia
 				return &(*e->instance)[magicIdx];
 			}
 
+			stats_->lookupMisses++;
 			return 0;
 		}
 
-		Instance* GetInstanceBefore(const JunctionStorage & storage, std::vector<VertexEntry* >& lastPosEntry, std::vector<VertexEntry* > &lastNegEntry, size_t chr0, uint64_t element, uint64_t mask)
+		//Every candidate needs a chain of dependent loads: the vertex record,
+		//the entry of the vertex and the instance. The vertex records are
+		//prefetched as the candidates are collected, the rest of the chain is
+		//walked one step at a time for the whole batch, prefetching the next
+		//step, so the latencies of the candidates overlap. The candidates are
+		//then checked in order
+		void EvaluateBatch(const JunctionStorage & storage,
+			VertexEntryIndex & lastEntry,
+			int32_t maxBranchSize,
+			const typename JunctionStorage::Iterator succ[2],
+			Candidate * batch,
+			size_t batchSize,
+			Instance *& ret,
+			uint32_t & bestScore) const
+		{
+			for (size_t i = 0; i < batchSize; i++)
+			{
+				int64_t vid = storage.GetVertexId(chr1_, batch[i].idx);
+				batch[i].vid = isPositiveStrand_ ? vid : -vid;
+				lastEntry.Prefetch(batch[i].vid);
+			}
+
+			for (size_t i = 0; i < batchSize; i++)
+			{
+				batch[i].inst = 0;
+				batch[i].entry = lastEntry.Get(batch[i].vid);
+				if (batch[i].entry != 0)
+				{
+					auto magicIdx = storage.GetPointerIndex(chr1_, batch[i].idx) - batch[i].entry->pointerIdx - 1;
+					if (magicIdx >= 0 && magicIdx < (*batch[i].entry->instance).size())
+					{
+						batch[i].inst = &(*batch[i].entry->instance)[magicIdx];
+						Prefetch(batch[i].inst);
+					}
+				}
+			}
+
+			for (size_t i = 0; i < batchSize; i++)
+			{
+				stats_->lookups++;
+				Instance * inst = batch[i].inst;
+				if (inst == 0)
+				{
+					stats_->lookupMisses++;
+					continue;
+				}
+
+				auto gapScore = Compatible(*inst, succ, maxBranchSize);
+				if (gapScore > 0 && (ret == 0 || (inst->score + gapScore > bestScore)))
+				{
+					ret = inst;
+					bestScore = inst->score + gapScore;
+				}
+			}
+		}
+
+		//The position of the junction as seen from the strand of the set
+		int64_t GetPosition(const JunctionStorage & storage, size_t idx) const
+		{
+			return typename JunctionStorage::Iterator(storage, chr1_, idx, isPositiveStrand_).GetPosition();
+		}
+
+		Instance* GetInstanceBefore(const JunctionStorage & storage, VertexEntryIndex & lastEntry, size_t chr0, uint64_t element, uint64_t mask)
 		{
 #ifdef _MSC_VER
 			uint64_t bit = 64 - __lzcnt64(mask);
@@ -403,10 +836,10 @@ namespace Sibelia
 			uint64_t bit = 64 - __builtin_clzll(mask);
 #endif
 			auto idx = (element << 6) | (bit - 1);
-			return GetMagicIndex(storage, lastPosEntry, lastNegEntry, idx);
+			return GetMagicIndex(storage, lastEntry, idx);
 		}
 
-		Instance* GetInstanceAfter(const JunctionStorage & storage, std::vector<VertexEntry* > &lastPosEntry, std::vector<VertexEntry* >& lastNegEntry, size_t chr0, uint64_t element, uint64_t mask)
+		Instance* GetInstanceAfter(const JunctionStorage & storage, VertexEntryIndex & lastEntry, size_t chr0, uint64_t element, uint64_t mask)
 		{
 #ifdef _MSC_VER
 			uint64_t bit = _tzcnt_u64(mask);
@@ -414,7 +847,7 @@ namespace Sibelia
 			uint64_t bit = __builtin_ctzll(mask);
 #endif
 			auto idx = (element << 6) | bit;
-			return GetMagicIndex(storage, lastPosEntry, lastNegEntry, idx);
+			return GetMagicIndex(storage, lastEntry, idx);
 		}
 
 		void GetCoord(uint64_t idx, uint64_t & element, uint64_t & bit) const
@@ -2,8 +2,8 @@
 #define _SWEEPER_H_
 
 #include <set>
-#include <deque>
 #include <queue>
+#include <limits>
 #include <cassert>
 #include <algorithm>
 
@@ -40,23 +40,226 @@ namespace Sibelia
 		size_t chr_;
 	};
 
-	class Sweeper
+	//Receives the blocks as soon as they are found. Consume is called
+	//concurrently from the worker threads, each call passes all instances of
+	//one block
+	class BlockSink
+	{
+	public:
+		virtual ~BlockSink()
+		{
+
+		}
+
+		virtual void Consume(const BlockInstance * instance, size_t count) = 0;
+	};
+
+	//The pairs of genomes (input FASTA files) to be mapped against each other.
+	//By default all pairs are mapped, including a genome against itself
+	class GenomePairs
+	{
+	public:
+		GenomePairs() : interOnly_(false)
+		{
+
+		}
+
+		//Only map different genomes against each other
+		void SetInterOnly(bool interOnly)
+		{
+			interOnly_ = interOnly;
+		}
+
+		//Only map reference genomes against the other ones
+		void AddReference(size_t genome)
+		{
+			reference_.insert(genome);
+		}
+
+		//Only map the genomes of the subset against each other
+		void AddSubset(size_t genome)
+		{
+			subset_.insert(genome);
+		}
+
+		//Only map pairs with at least one new genome, the other pairs are
+		//known from a previous run
+		void AddNew(size_t genome)
+		{
+			new_.insert(genome);
+		}
+
+		bool Allowed(size_t genome1, size_t genome2) const
+		{
+			if (interOnly_ && genome1 == genome2)
+			{
+				return false;
+			}
+
+			if (!subset_.empty() && (subset_.count(genome1) == 0 || subset_.count(genome2) == 0))
+			{
+				return false;
+			}
+
+			if (!reference_.empty() && (reference_.count(genome1) > 0) == (reference_.count(genome2) > 0))
+			{
+				return false;
+			}
+
+			if (!new_.empty() && new_.count(genome1) == 0 && new_.count(genome2) == 0)
+			{
+				return false;
+			}
+
+			return true;
+		}
+
+	private:
+		bool interOnly_;
+		std::set<size_t> new_;
+		std::set<size_t> subset_;
+		std::set<size_t> reference_;
+	};
+
+	//A queue of a fixed capacity. Elements never move, so pointers to them stay
+	//valid until they are popped
+	template<class T>
+	class RingBuffer
 	{
 	public:
+		RingBuffer(size_t capacity) : head_(0), size_(0), item_(capacity)
+		{
 
-		typedef std::multiset<Instance>::iterator InstanceIt;
+		}
 
-		Sweeper(JunctionStorage::Iterator start, std::vector<VertexEntry* > & lastPosEntry_, std::vector<VertexEntry* > & lastNegEntry_) :
-			start_(start), lastPosEntry_(lastPosEntry_), lastNegEntry_(lastNegEntry_)
+		void push_back(const T & value)
+		{
+			assert(size_ < item_.size());
+			item_[(head_ + size_++) % item_.size()] = value;
+		}
+
+		void pop_front()
+		{
+			head_ = (head_ + 1) % item_.size();
+			size_--;
+		}
+
+		T & front()
+		{
+			return item_[head_];
+		}
+
+		T & back()
+		{
+			return item_[(head_ + size_ - 1) % item_.size()];
+		}
+
+		size_t size() const
+		{
+			return size_;
+		}
+
+		size_t capacity() const
+		{
+			return item_.size();
+		}
+
+	private:
+		size_t head_;
+		size_t size_;
+		std::vector<T> item_;
+	};
+
+	//Per-thread memory of the sweeps: the instance buffers of the vertex
+	//entries, the purge window and the vertex index. The window never holds
+	//more than maxBranchSize + 1 entries, so everything is allocated once and
+	//reused by every sweep of the thread
+	template<class Width>
+	class SweepArena
+	{
+	public:
+		typedef Sibelia::Instance<Width> Instance;
+		typedef Sibelia::VertexEntry<Width> VertexEntry;
+		typedef Sibelia::VertexEntryIndex<Width> VertexEntryIndex;
+
+		SweepArena(int32_t maxBranchSize, size_t abundance) : buffer(maxBranchSize + 1), purge(maxBranchSize + 1), lastEntry(maxBranchSize + 2)
+		{
+			for (auto & it : buffer)
+			{
+				it.reserve(abundance);
+				pool.push_back(&it);
+			}
+		}
+
+		size_t GetMemoryUsage() const
+		{
+			size_t ret = lastEntry.GetMemoryUsage() + purge.capacity() * sizeof(VertexEntry) + pool.capacity() * sizeof(pool[0]);
+			for (auto & it : buffer)
+			{
+				ret += it.capacity() * sizeof(Instance);
+			}
+
+			return ret;
+		}
+
+		std::vector<std::vector<Instance> > buffer;
+		std::vector<std::vector<Instance>* > pool;
+		RingBuffer<VertexEntry> purge;
+		VertexEntryIndex lastEntry;
+		SweepStats stats;
+	};
+
+	//Observes the lookups and purges of a sweep. This probe does nothing and is
+	//optimized away, the benchmark passes its own one to time the calls
+	struct SweepProbe
+	{
+		enum Call
+		{
+			EXACT_LOOKUP,
+			BEST_LOOKUP,
+			PURGE,
+			CALLS
+		};
+
+		void Start()
+		{
+
+		}
+
+		void Stop(Call)
+		{
+
+		}
+	};
+
+	template<class Width, class Probe = SweepProbe>
+	class Sweeper
+	{
+	public:
+		typedef typename Width::Coordinate Coordinate;
+		typedef Sibelia::Instance<Width> Instance;
+		typedef Sibelia::VertexEntry<Width> VertexEntry;
+		typedef Sibelia::InstanceSet<Width> InstanceSet;
+		typedef Sibelia::SweepArena<Width> SweepArena;
+		typedef Sibelia::VertexEntryIndex<Width> VertexEntryIndex;
+		typedef Sibelia::JunctionStorage<Width> JunctionStorage;
+
+		//Only the pairs with the chromosomes of the marked partner genomes are
+		//mapped, and the occurrences are not followed to chromosomes past
+		//partnerEnd. A sweeper may also be restricted to a part of the partner
+		//chromosomes and strands. Chains never cross partners, so the parts are
+		//independent and together give the same blocks as a single sweep
+		Sweeper(typename JunctionStorage::Iterator start, SweepArena & arena, const std::vector<char> & partner, size_t partnerEnd, size_t part = 0, size_t parts = 1) :
+			start_(start), purge_(arena.purge), pool_(arena.pool), lastEntry_(arena.lastEntry), stats_(arena.stats), partner_(partner), partnerEnd_(partnerEnd), part_(part), parts_(parts)
 		{
 
 		}
 
 		void Purge(JunctionStorage & storage,
-			int32_t lastPos,
+			Coordinate lastPos,
 			int32_t k,
 			std::atomic<int64_t> & blocksFound,
-			std::vector<BlockInstance> & blocksInstance,
+			BlockSink & sink,
 			int32_t minBlockSize,
 			int32_t maxBranchSize,
 			std::vector<std::vector<InstanceSet> > & instance,
@@ -66,20 +269,29 @@ namespace Sibelia
 			{
 				if (purge_.front().instance->size() > 0)
 				{
-					int32_t diff = lastPos - (purge_.front().instance->front().endPosition[0]);
+					Coordinate diff = lastPos - (purge_.front().instance->front().endPosition[0]);
 					if (diff >= maxBranchSize)
 					{
 						for (auto & it : *purge_.front().instance)
 						{
 							int64_t chrId = abs(it.chrId) - 1;
 							size_t strand = it.chrId > 0 ? 0 : 1;
+							if (!Owns(storage, chrId, strand))
+							{
+								continue;
+							}
+
 							bool hasNext = it.hasNext;
 							if (it.Valid(minBlockSize) && !hasNext)
 							{
-								ReportBlock(blocksInstance, chrId, k, blocksFound, it);
+								ReportBlock(sink, chrId, k, blocksFound, it);
+							}
+							else if (!hasNext)
+							{
+								stats_.chainsFiltered++;
 							}
 
-							instance[strand][chrId].Erase(&it, storage, lastPosEntry_, lastNegEntry_, maxBranchSize, start_.GetChrId(), it.idx);
+							instance[strand][chrId].Erase(&it, storage, lastEntry_, maxBranchSize, start_.GetChrId(), it.idx);
 						}
 						
 						NotifyPop(purge_.front());
@@ -113,18 +325,11 @@ namespace Sibelia
 			int32_t maxBranchSize,
 			int32_t k,
 			std::atomic<int64_t> & blocksFound,
-			std::vector<BlockInstance> & blocksInstance,
+			BlockSink & sink,
 			std::vector<std::vector<InstanceSet> > & instance)
 		{
-			
-			for (size_t i = 0; i < maxBranchSize + 1; i++)
-			{
-				pool_.push_back(new std::vector<Instance>());
-				pool_.back()->reserve(storage.GetAbundance());
-			}
-
-			JunctionStorage::Iterator itPrev;
-			JunctionStorage::Iterator successor[2];
+			typename JunctionStorage::Iterator itPrev;
+			typename JunctionStorage::Iterator successor[2];
 			for (auto it = start_; it.Valid(); it.Inc())
 			{
 				auto jt = it;
@@ -135,13 +340,35 @@ namespace Sibelia
 					size_t idx = jt.GetIndex();
 					int32_t chrId = jt.GetChrId();
 					size_t strand = jt.IsPositiveStrand() ? 0 : 1;
+					if (size_t(chrId) >= partnerEnd_)
+					{
+						break;
+					}
+
 					successor[0] = it;
 					successor[1] = jt;
+					if (!Owns(storage, chrId, strand))
+					{
+						//Keeps the instance indices aligned with the pointer indices
+						purge_.back().instance->push_back(Instance(it, jt));
+						continue;
+					}
 
-					auto kt = instance[strand][chrId].TryRetreiveExact(storage, lastPosEntry_, lastNegEntry_, successor, itPrev);
+					stats_.pairs++;
+					probe_.Start();
+					auto kt = instance[strand][chrId].TryRetreiveExact(storage, lastEntry_, successor, itPrev);
+					probe_.Stop(SweepProbe::EXACT_LOOKUP);
 					if (kt.first == 0)
 					{
-						kt = instance[strand][chrId].RetreiveBest(storage, lastPosEntry_, lastNegEntry_, maxBranchSize, successor);
+						stats_.bestSearches++;
+						probe_.Start();
+						kt = instance[strand][chrId].RetreiveBest(storage, lastEntry_, maxBranchSize, successor);
+						probe_.Stop(SweepProbe::BEST_LOOKUP);
+						stats_.bestHits += kt.first != 0 ? 1 : 0;
+					}
+					else
+					{
+						stats_.exactHits++;
 					}
 				
 					if (kt.first != 0)
@@ -160,70 +387,68 @@ namespace Sibelia
 				}
 
 				NotifyPush(purge_.back());
-				Purge(storage, it.GetPosition(), k, blocksFound, blocksInstance, minBlockSize, maxBranchSize, instance, 0);
+				stats_.peakPurge = std::max(stats_.peakPurge, uint64_t(purge_.size()));
+				probe_.Start();
+				Purge(storage, it.GetPosition(), k, blocksFound, sink, minBlockSize, maxBranchSize, instance, 0);
+				probe_.Stop(SweepProbe::PURGE);
 				itPrev = it;
 			}
 
-			Purge(storage, INT32_MAX, k, blocksFound, blocksInstance, minBlockSize, maxBranchSize, instance, 0);
-			for (auto pt : pool_)
-			{
-				delete pt;
-			}
+			Purge(storage, std::numeric_limits<Coordinate>::max(), k, blocksFound, sink, minBlockSize, maxBranchSize, instance, 0);
+		}
+
+		Probe & GetProbe()
+		{
+			return probe_;
 		}
 
 
 	private:
-		JunctionStorage::Iterator start_;
-		std::deque<VertexEntry> purge_;
-		std::vector<std::vector<Instance>* > pool_;
-		std::vector<VertexEntry* > & lastPosEntry_;
-		std::vector<VertexEntry* > & lastNegEntry_;
+		typename JunctionStorage::Iterator start_;
+		RingBuffer<VertexEntry> & purge_;
+		std::vector<std::vector<Instance>* > & pool_;
+		VertexEntryIndex & lastEntry_;
+		SweepStats & stats_;
+		const std::vector<char> & partner_;
+		size_t partnerEnd_;
+		size_t part_;
+		size_t parts_;
+		Probe probe_;
+
+		bool Owns(const JunctionStorage & storage, size_t chrId, size_t strand) const
+		{
+			return partner_[storage.GetChrGenome(chrId)] && (parts_ == 1 || (chrId * 2 + strand) % parts_ == part_);
+		}
 
 		void NotifyPush(VertexEntry & e)
 		{
-			if (e.vertexId > 0)
-			{
-				lastPosEntry_[e.vertexId] = &e;
-			}
-			else
-			{
-				lastNegEntry_[-e.vertexId] = &e;
-			}
+			lastEntry_.Set(e.vertexId, &e);
 		}
 
 		void NotifyPop(VertexEntry & e)
 		{
-			if (e.vertexId > 0)
-			{
-				if (lastPosEntry_[e.vertexId] == &e)
-				{
-					lastPosEntry_[e.vertexId] = 0;
-				}
-			}
-			else
-			{
-				if (lastNegEntry_[-e.vertexId] == &e)
-				{
-					lastNegEntry_[-e.vertexId] = 0;
-				}
-			}
+			lastEntry_.Erase(e.vertexId, &e);
 		}
 
-		void ReportBlock(std::vector<BlockInstance> & blocksInstance, int64_t chrId1, int64_t k, std::atomic<int64_t> & blocksFound, const Instance & inst)
+		void ReportBlock(BlockSink & sink, int64_t chrId1, int64_t k, std::atomic<int64_t> & blocksFound, const Instance & inst)
 		{
+			BlockInstance block[2];
 			int64_t chrId[] = { start_.GetChrId(), chrId1 };
 			int64_t currentBlock = ++blocksFound;
+			stats_.blocksReported++;
 			for (size_t l = 0; l < 2; l++)
 			{
 				if (inst.endPosition[l] >= 0)
 				{
-					blocksInstance.push_back(BlockInstance(+currentBlock, chrId[l], inst.startPosition[l], inst.endPosition[l] + k));
+					block[l] = BlockInstance(+currentBlock, chrId[l], inst.startPosition[l], inst.endPosition[l] + k);
 				}
 				else
 				{
-					blocksInstance.push_back(BlockInstance(-currentBlock, chrId[l], -(inst.endPosition[l]) - k, -inst.startPosition[l]));
+					block[l] = BlockInstance(-currentBlock, chrId[l], -(inst.endPosition[l]) - k, -inst.startPosition[l]);
 				}
 			}
+
+			sink.Consume(block, 2);
 		}
 		
 	};
@@ -0,0 +1,79 @@
+#Parameters description
+#1) Numbers of genomes, comma-separated, e.g. 2,4,8
+#2) Numbers of threads, comma-separated, e.g. 1,2,4,8
+#3) Path to the directory containing genomes (*.fna or *.fa). If it has none,
+#   synthetic genomes are generated into it by bubbz-bench
+#Environment: BIN is the directory with twopaco, bubbz-map and bubbz-bench
+#(default .), OUT is the output directory (default scaling_out), LENGTH is
+#the length of a synthetic genome (default 5000000), ABUNDANCE is -a
+#(default 150), MEMORY is the Bloom filter size of TwoPaCo in GB (default 4)
+#and TIMER is GNU time (default /usr/bin/time)
+#The results are written to $OUT/scaling.csv and $OUT/scaling.json. The
+#speedup and parallel efficiency are relative to the first thread count.
+
+echoerr() { echo "$@" 1>&2; }
+
+if [ -z "$3" ]
+then
+	echoerr "Usage: runScaling.sh <genome counts> <thread counts> <genomes directory>"
+	exit 1
+fi
+
+bin=${BIN:-.}
+out=${OUT:-scaling_out}
+length=${LENGTH:-5000000}
+abundance=${ABUNDANCE:-150}
+memory=${MEMORY:-4}
+timer=${TIMER:-/usr/bin/time}
+gdir=$3
+k=21
+IFS=',' read -ra counts <<< "$1"
+IFS=',' read -ra threads <<< "$2"
+
+maxcount=0
+for n in "${counts[@]}"; do
+	[ "$n" -gt "$maxcount" ] && maxcount=$n
+done
+
+files=($(ls $gdir/*.fna $gdir/*.fa 2> /dev/null | sort -V))
+if [ ${#files[@]} -eq 0 ]
+then
+	echoerr "Generating $maxcount synthetic genomes in $gdir"
+	$bin/bubbz-bench --fasta $gdir -g $maxcount -l $length -k $k > /dev/null || exit 1
+	files=($(ls $gdir/*.fa | sort -V))
+fi
+
+if [ ${#files[@]} -lt $maxcount ]
+then
+	echoerr "The directory $gdir has fewer than $maxcount genomes"
+	exit 1
+fi
+
+#Reads a phase time from run_stats.json
+phase() { sed -n "s/.*\"$2\": \([0-9.e+-]*\).*/\1/p" $1; }
+
+mkdir -p $out
+csv=$out/scaling.csv
+echo "genomes,threads,wall_seconds,peak_rss_kb,load,schedule,sweep,merge_runs,output,speedup,efficiency,sweep_efficiency" > $csv
+for n in "${counts[@]}"
+do
+	dir=$out/genomes_$n
+	mkdir -p $dir
+	input="${files[@]:0:$n}"
+	dbfile=$dir/graph.dbg
+	$timer -f "%e %M" -o $dir/twopaco_time.txt $bin/twopaco -t $(( ${threads[-1]} < 16 ? ${threads[-1]} : 16 )) -k $k --filtermemory $memory -a $abundance --tmpdir $dir -o $dbfile $input > $dir/twopaco_log.txt 2>&1 || { echoerr "TwoPaCo failed for $n genomes"; exit 1; }
+	base=
+	for t in "${threads[@]}"
+	do
+		rundir=$dir/threads_$t
+		$timer -f "%e %M" -o $dir/time_$t.txt $bin/bubbz-map --graph $dbfile $input -k $k -b 200 -m 250 -a $abundance -t $t -o $rundir > $dir/log_$t.txt 2>&1 || { echoerr "bubbz-map failed for $n genomes and $t threads"; exit 1; }
+		read wall rss < <(tail -1 $dir/time_$t.txt)
+		stats=$rundir/run_stats.json
+		sweep=$(phase $stats sweep)
+		[ -z "$base" ] && base="$t $wall $sweep"
+		echo "$n,$t,$wall,$rss,$(phase $stats load),$(phase $stats schedule),$sweep,$(phase $stats merge_runs),$(phase $stats output)" | awk -F, -v base="$base" 'BEGIN { OFS = "," } { split(base, b, " "); speedup = ($3 > 0 ? b[2] / $3 : 0); print $0, speedup, speedup * b[1] / $2, ($7 > 0 ? b[3] / $7 * b[1] / $2 : 0) }' >> $csv
+		echoerr "$n genomes, $t threads: $wall s"
+	done
+done
+
+awk -F, 'NR == 1 { split($0, key, ","); print "["; next } { printf "%s\t{", (NR > 2 ? ",\n" : ""); for (i = 1; i <= NF; i++) printf "%s\"%s\": %s", (i > 1 ? ", " : ""), key[i], ($i == "" ? "null" : $i); printf "}" } END { print "\n]" }' $csv > $out/scaling.json